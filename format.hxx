@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+namespace Format {
+
+// Large enough to hold any value produced by the writers below
+constexpr int bufferSize = 32;
+
+// Write the decimal representation of VALUE at OUT.
+// Return a pointer past the last written character.
+inline char * integer (char * out, long long value) {
+  unsigned long long u = value;
+  if (value < 0) {
+    *out++ = '-';
+    u = -u;
+  }
+
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  while (n > 0)
+    *out++ = digits[--n];
+  return out;
+}
+
+// Write MANTISSA * 10^-DECIMALS at OUT, without trailing zeros.
+// Return a pointer past the last written character.
+inline char * fixed (char * out, long long mantissa, int decimals) {
+  if (mantissa < 0) {
+    *out++ = '-';
+    mantissa = -mantissa;
+  }
+
+  long long scale = 1;
+  for (int i = 0 ; i < decimals ; ++i)
+    scale *= 10;
+
+  out = integer (out, mantissa / scale);
+
+  long long frac = mantissa % scale;
+  if (frac) {
+    while (frac % 10 == 0) {
+      frac /= 10;
+      --decimals;
+    }
+
+    *out++ = '.';
+    for (int i = decimals-1 ; i >= 0 ; --i) {
+      out[i] = '0' + frac % 10;
+      frac /= 10;
+    }
+    out += decimals;
+  }
+  return out;
+}
+
+// Fixed-point timestamp, counted in ticks of RESOLUTION milliseconds
+class Time {
+public:
+  Time (long long ticks, int resolution)
+    : ticks_      (ticks),
+      resolution_ (resolution)
+  {}
+
+  static Time fromSeconds (double seconds, int resolution) {
+    return Time (std::llround (seconds * 1000 / resolution), resolution);
+  }
+
+  long long ticks () const { return ticks_; }
+  long long ms ()    const { return ticks_ * resolution_; }
+
+  Time operator- (const Time & other) const {
+    return Time (ticks_ - other.ticks_, resolution_);
+  }
+
+private:
+  long long ticks_;
+  int       resolution_;
+};
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value, char*>::type
+write (char * out, T value) {
+  return integer (out, value);
+}
+
+// Coordinates are rounded to the millipixel
+inline char * write (char * out, double value) {
+  return fixed (out, std::llround (value * 1000), 3);
+}
+
+// Times are written in seconds
+inline char * write (char * out, const Time & value) {
+  return fixed (out, value.ms(), 3);
+}
+
+// Length of the formatted representation of VALUE
+template <typename T>
+inline size_t length (const T & value) {
+  char buffer[bufferSize];
+  return write (buffer, value) - buffer;
+}
+}
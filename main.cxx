@@ -1,19 +1,32 @@
 #include "string.hxx"
 #include "logger.hxx"
 #include "terminal.hxx"
+#include "server.hxx"
 #include "config.h"
 #include <iostream>
+#include <set>
+#include <thread>
 #include <boost/program_options.hpp>
 
 using std::string;
 
-int main (int argc, char **argv)
+// Run script2svg with command-line arguments ARGS (including the program
+// name), either locally or on behalf of a server client
+int convert (const std::vector<string> & args, const Server::Environment & env,
+             std::ostream & stdOut, std::ostream & stdErr)
 {
   using Log::ERROR;
   using Log::WARNING;
   using Log::NOTICE;
   using Log::INFO;
-  Log::Logger log {std::cerr};
+  Log::Logger log {stdErr};
+
+  // Relative paths are resolved from the client working directory
+  auto path = [&](const string & p) {
+    if (env.cwd == "" or p == "" or p == "-" or p[0] == '/')
+      return p;
+    return env.cwd + "/" + p;
+  };
 
   try {
 // * Options definition
@@ -56,12 +69,39 @@ int main (int argc, char **argv)
        po::value<std::vector<string>>()
        ->value_name("FILE"),
        "read config file")
+      ("variant",
+       po::value<std::vector<string>>()
+       ->value_name("FILE"),
+       "produce an additional output from the same recording, with fonts,"
+       " colors, progress bar, advertisement and output file read from"
+       " config file FILE")
       ("output,o",
        po::value<string>(&options.output)
        ->value_name("SVG_FILE")
        ->default_value("-"),
        "specify the output file name. The default behaviour is to use"
-       " the standard output.");
+       " the standard output.")
+      ("max-size",
+       po::value<size_t>(&options.maxSize)
+       ->value_name("BYTES")
+       ->default_value(0),
+       "maximum size of each output (variants included). If needed, the"
+       " animation timing is degraded to fit in BYTES. The default behaviour"
+       " (0) is to never degrade the animation.")
+      ("segment",
+       po::value<double>(&options.segment)
+       ->value_name("SECONDS")
+       ->default_value(0),
+       "split the animation in self-contained SVG files of SECONDS each,"
+       " named after the output file (`OUT.000.svg', `OUT.001.svg'...)."
+       " The output file itself, which should then be named `OUT.html',"
+       " gets an HTML page playing them in turn, loading each segment only"
+       " when needed.")
+      ("analyze",
+       po::bool_switch(&options.analyze),
+       "do not produce any animation; instead, output metrics about the"
+       " recording (duration, size, number of updates, estimated SVG size...)"
+       " as a JSON object.");
     optionsAll.add (optionsGeneric);
     optionsDoc.add (optionsGeneric);
 
@@ -113,6 +153,24 @@ int main (int argc, char **argv)
     optionsAll.add (optionsFont);
     optionsDoc.add (optionsFont);
 
+// ** Timing
+    po::options_description optionsTiming {"Timing"};
+    optionsTiming.add_options()
+      ("timing.resolution",
+       po::value<int>(&options.timing.resolution)
+       ->value_name ("MS")
+       ->default_value (1),
+       "time resolution of the animation, in milliseconds.\nCoarser"
+       " resolutions produce smaller files.")
+      ("timing.frame",
+       po::value<int>(&options.timing.frame)
+       ->value_name ("     MS")
+       ->default_value (0),
+       "minimum duration of a frame, in milliseconds.\nShorter frames are"
+       " merged into the next one.");
+    optionsAll.add (optionsTiming);
+    optionsDoc.add (optionsTiming);
+
 // ** Progress bar
     po::options_description optionsProgress {"Progress bar"};
     optionsProgress.add_options()
@@ -206,11 +264,40 @@ int main (int argc, char **argv)
     optionsAll.add (optionsAd);
     optionsDoc.add (optionsAd);
 
+// ** Server
+    po::options_description optionsServer {
+        String("Server:\n"
+               "A conversion server can be run in the background, in order to avoid"
+               " paying the startup costs for each conversion")
+          .wordWrap (m_default_line_length)
+          .str()};
+    optionsServer.add_options()
+      ("serve",
+       po::value<string>()
+       ->value_name ("SOCKET"),
+       "run a conversion server, listening on the Unix domain socket SOCKET")
+      ("jobs,j",
+       po::value<int>()
+       ->value_name ("NB")
+       ->default_value (std::max (1u, std::thread::hardware_concurrency()),
+                       "number of CPUs"),
+       "number of concurrent conversions run by the server")
+      ("connect",
+       po::value<string>()
+       ->value_name ("SOCKET"),
+       "run the conversion on the server listening on SOCKET, instead of"
+       " locally. All other options are forwarded to the server.")
+      ("stats",
+       "with --connect, output the server metrics (queue depth, job latency...)"
+       " as a JSON object");
+    optionsAll.add (optionsServer);
+    optionsDoc.add (optionsServer);
+
 
 // * Command-line parsing (step 1)
     auto help = [&](std::ostream & out) {
       out
-      << "Usage: " << argv[0] << " [options] SCRIPT_FILE TIMING_FILE" << std::endl
+      << "Usage: " << args[0] << " [options] SCRIPT_FILE TIMING_FILE" << std::endl
       << std::endl
       << String ("Produce an animated SVG representation of a recorded script session.")
       .wordWrap (m_default_line_length)
@@ -221,7 +308,7 @@ int main (int argc, char **argv)
     po::variables_map vm;
     try {
       po::store
-        (po::command_line_parser (argc, argv)
+        (po::command_line_parser (std::vector<string> (args.begin() + 1, args.end()))
          .options (optionsAll)
          .positional (positional)
          .run(),
@@ -238,13 +325,13 @@ int main (int argc, char **argv)
 
     // --help
     if (vm.count ("help")) {
-      help (std::cout);
+      help (stdOut);
       return 0;
     }
 
     // --version
     if (vm.count ("version")) {
-      std::cout << "script2svg "
+      stdOut << "script2svg "
                 << SCRIPT2SVG_VERSION_MAJOR << "." << SCRIPT2SVG_VERSION_MINOR
                 << std::endl;
       return 0;
@@ -259,6 +346,32 @@ int main (int argc, char **argv)
         });
     }
 
+// * Server
+
+    // --serve
+    if (vm.count ("serve")) {
+      if (env.remote)
+        throw std::runtime_error ("a server can not be started by a server client");
+
+      const int jobs = vm["jobs"].as<int>();
+      if (jobs <= 0)
+        throw std::runtime_error ("invalid number of jobs; "
+                                  "`--jobs' should be a positive number");
+
+      return Server::serve (path (vm["serve"].as<string>()), jobs, log, convert);
+    }
+
+    // --connect
+    //
+    // Jobs received by the server still have their `--connect' option, which
+    // is then ignored.
+    if (vm.count ("connect") and not env.remote) {
+      const string socket = path (vm["connect"].as<string>());
+      if (vm.count ("stats"))
+        return Server::stats (socket, stdOut);
+      return Server::submit (socket, args, env, stdOut, stdErr);
+    }
+
 // * Command-line parsing (step 2)
     try {
       po::notify(vm);
@@ -278,7 +391,7 @@ int main (int argc, char **argv)
                 << std::endl;
           });
         try {
-          po::store (po::parse_config_file<char> (fileName.c_str(), optionsDoc),
+          po::store (po::parse_config_file<char> (path (fileName).c_str(), optionsDoc),
                      vm);
         } catch (po::reading_file & e){
           log.msg<WARNING> (e.what());
@@ -293,9 +406,8 @@ int main (int argc, char **argv)
 
 // ** Terminal size
     if (options.columns == 0) {
-      const char * var = std::getenv("COLUMNS");
-      if (var) {
-        std::istringstream iss {var};
+      if (env.columns != "") {
+        std::istringstream iss {env.columns};
         iss >> options.columns;
       } else {
         throw std::runtime_error
@@ -305,9 +417,8 @@ int main (int argc, char **argv)
     }
 
     if (options.rows == 0) {
-      const char * var = std::getenv("LINES");
-      if (var) {
-        std::istringstream iss {var};
+      if (env.lines != "") {
+        std::istringstream iss {env.lines};
         iss >> options.rows;
       } else {
         throw std::runtime_error
@@ -316,21 +427,119 @@ int main (int argc, char **argv)
       }
     }
 
-// ** Font size
-    if (options.font.dx == 0) {
-      options.font.dx = options.font.size * 0.67;
+// ** Segmented output
+    if (options.segment < 0) {
+      throw std::runtime_error
+        ("invalid segment duration; "
+         "`--segment' should be a non-negative number of seconds");
+    }
+
+    // With `--analyze', segments are only accounted for in the metrics
+    const bool segmented = options.segment > 0 and not options.analyze;
+
+    if (segmented and options.output == "-") {
+      throw std::runtime_error
+        ("segmented output can not be written to the standard output; "
+         "please provide the `--output' command-line option");
     }
 
-    if (options.font.dy == 0) {
-      options.font.dy = std::max (options.font.size * 1.3,
-                                  options.font.size + 2.);
+    if (segmented and not String (options.output).endsWith (".html")) {
+      throw std::runtime_error
+        ("segmented output is played by an HTML page; "
+         "the `--output' file name should end with `.html'");
     }
 
+// ** Time resolution
+    if (options.timing.resolution <= 0) {
+      throw std::runtime_error
+        ("invalid time resolution; "
+         "`--timing.resolution' should be a positive number of milliseconds");
+    }
+
+    if (options.timing.frame < 0) {
+      throw std::runtime_error
+        ("invalid frame duration; "
+         "`--timing.frame' should be a non-negative number of milliseconds");
+    }
+
+// ** Output variants
+    //
+    // Variants start from the main options, and may override the options which
+    // do not affect the emulation.
+    std::vector<Terminal::Options> variants;
+    if (vm.count("variant") and options.analyze) {
+      throw std::runtime_error
+        ("`--analyze' does not produce any output; "
+         "it can not be combined with `--variant'");
+    }
+
+    // Each output file is written by its own thread
+    std::set<string> outputs {path (options.output)};
+    if (vm.count("variant"))
+      for (const string & fileName: vm["variant"].as<std::vector<string>>()) {
+        log.write<NOTICE> ([&](auto && out){
+            out << "reading variant file: '" << fileName << "'"
+                << std::endl;
+          });
+
+        Terminal::Options variant = options;
+        po::options_description optionsVariant;
+        optionsVariant.add_options()
+          ("output",          po::value<string>(&variant.output))
+          ("font.family",     po::value<string>(&variant.font.family))
+          ("font.size",       po::value<int>(&variant.font.size))
+          ("font.dx",         po::value<int>(&variant.font.dx))
+          ("font.dy",         po::value<int>(&variant.font.dy))
+          ("progress.height", po::value<int>(&variant.progress.height))
+          ("progress.color",  po::value<string>(&variant.progress.color))
+          ("color.fg",        po::value<string>(&variant.color.fg))
+          ("color.bg",        po::value<string>(&variant.color.bg))
+          ("color.black",     po::value<string>(&variant.color.black))
+          ("color.red",       po::value<string>(&variant.color.red))
+          ("color.green",     po::value<string>(&variant.color.green))
+          ("color.yellow",    po::value<string>(&variant.color.yellow))
+          ("color.blue",      po::value<string>(&variant.color.blue))
+          ("color.magenta",   po::value<string>(&variant.color.magenta))
+          ("color.cyan",      po::value<string>(&variant.color.cyan))
+          ("color.white",     po::value<string>(&variant.color.white))
+          ("ad.text",         po::value<string>(&variant.ad.text))
+          ("ad.url",          po::value<string>(&variant.ad.url));
+
+        po::variables_map vmVariant;
+        try {
+          po::store (po::parse_config_file<char> (path (fileName).c_str(), optionsVariant),
+                     vmVariant);
+          po::notify (vmVariant);
+        } catch (po::error & e) {
+          log.msg<ERROR> (e.what());
+          return 3;
+        }
+
+        // Cell sizes are derived from the font size by the terminal
+        if (not vmVariant.count ("font.dx") and vmVariant.count ("font.size"))
+          variant.font.dx = 0;
+        if (not vmVariant.count ("font.dy") and vmVariant.count ("font.size"))
+          variant.font.dy = 0;
+
+        if (variant.output == "-"
+            or not outputs.insert (path (variant.output)).second) {
+          throw std::runtime_error
+            ("variant `" + fileName + "' should have its own output file");
+        }
+        if (segmented and not String (variant.output).endsWith (".html")) {
+          throw std::runtime_error
+            ("variant `" + fileName + "': segmented output file name"
+             " should end with `.html'");
+        }
+        variant.output = path (variant.output);
+        variants.push_back (variant);
+      }
 
 // * Real work
-    Terminal term (options, log);
-    term.play(vm["script-file"].as<string>(),
-              vm["timing-file"].as<string>());
+    options.output = path (options.output);
+    Terminal term (options, variants, log, stdOut);
+    term.play(path (vm["script-file"].as<string>()),
+              path (vm["timing-file"].as<string>()));
   } catch (std::runtime_error & e) {
     log.msg<ERROR> (e.what());
     return 4;
@@ -338,3 +547,15 @@ int main (int argc, char **argv)
 
   return 0;
 }
+
+int main (int argc, char **argv)
+{
+  auto getenv = [](const char * name) -> string {
+    const char * var = std::getenv (name);
+    return var ? var : "";
+  };
+
+  const Server::Environment env {"", getenv ("COLUMNS"), getenv ("LINES"), false};
+  return convert (std::vector<string> (argv, argv + argc), env,
+                  std::cout, std::cerr);
+}
@@ -0,0 +1,478 @@
+#include "server.hxx"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using Log::ERROR;
+using Log::WARNING;
+using Log::NOTICE;
+using Log::INFO;
+using Log::DEBUG;
+
+using std::string;
+
+// Protocol
+// --------
+//
+// Requests are sent by the client as a list of NUL-terminated fields, preceded
+// by their number:
+//   N \0 COMMAND \0 CWD \0 COLUMNS \0 LINES \0 ARG1 \0 ... ARGn \0
+// where COMMAND is either "job" (with at least one argument: the program name)
+// or "stats" (without arguments).
+//
+// Replies are sent by the server as a sequence of frames:
+//   CHANNEL LENGTH \n PAYLOAD
+// where CHANNEL is '1' (standard output), '2' (error output) or 'x' (exit
+// status, terminating the reply).
+
+namespace Server {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Time given to clients to send their request, in seconds
+constexpr int requestTimeout = 10;
+
+// Limits on the requests sent by clients
+constexpr size_t maxFields    = 1024;
+constexpr size_t maxFieldSize = 64 * 1024;
+
+void fail (const string & what)
+{
+  std::ostringstream oss;
+  oss << what << ": " << std::strerror (errno);
+  throw std::runtime_error {oss.str()};
+}
+
+// File descriptor, closed on destruction
+class Socket {
+public:
+  explicit Socket (int fd)
+    : fd_ (fd)
+  {}
+
+  ~Socket () {
+    if (fd_ >= 0)
+      close (fd_);
+  }
+
+  // Non-copyable
+  Socket (const Socket &) = delete;
+
+  int operator() () const { return fd_; }
+
+private:
+  int fd_;
+};
+
+sockaddr_un address (const string & path)
+{
+  sockaddr_un addr;
+  std::memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path)
+    throw std::runtime_error {"socket path too long: `" + path + "'"};
+  std::strcpy (addr.sun_path, path.c_str());
+  return addr;
+}
+
+bool writeAll (int fd, const char * data, size_t len)
+{
+  while (len > 0) {
+    const ssize_t n = write (fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len  -= n;
+  }
+  return true;
+}
+
+bool sendFrame (int fd, char channel, const char * data, size_t len)
+{
+  std::ostringstream header;
+  header << channel << len << '\n';
+  return writeAll (fd, header.str().data(), header.str().size())
+    and  writeAll (fd, data, len);
+}
+
+// Buffered reads from a socket
+class Reader {
+public:
+  explicit Reader (int fd)
+    : fd_  (fd),
+      pos_ (0)
+  {}
+
+  // Read up to (and excluding) DELIM; return false on end of stream, or if
+  // more than MAX characters come before DELIM
+  bool until (char delim, string & str, size_t max = string::npos) {
+    str.clear();
+    while (true) {
+      const auto end = buffer_.find (delim, pos_);
+      if (end != string::npos) {
+        str.append (buffer_, pos_, end - pos_);
+        pos_ = end + 1;
+        return str.size() <= max;
+      }
+      str.append (buffer_, pos_, string::npos);
+      if (str.size() > max or not fill())
+        return false;
+    }
+  }
+
+  // Read exactly LEN bytes; return false on end of stream
+  bool exactly (size_t len, string & str) {
+    str.clear();
+    while (true) {
+      const size_t n = std::min (len - str.size(), buffer_.size() - pos_);
+      str.append (buffer_, pos_, n);
+      pos_ += n;
+      if (str.size() == len)
+        return true;
+      if (not fill())
+        return false;
+    }
+  }
+
+private:
+  bool fill () {
+    char chunk[4096];
+    ssize_t n;
+    do {
+      n = read (fd_, chunk, sizeof chunk);
+    } while (n < 0 and errno == EINTR);
+    if (n <= 0)
+      return false;
+    buffer_.assign (chunk, n);
+    pos_ = 0;
+    return true;
+  }
+
+  int         fd_;
+  string      buffer_;
+  size_t      pos_;
+};
+
+void sendFields (int fd, const std::vector<string> & fields)
+{
+  std::ostringstream oss;
+  oss << fields.size() << '\0';
+  for (const auto & field: fields)
+    oss << field << '\0';
+  if (not writeAll (fd, oss.str().data(), oss.str().size()))
+    fail ("could not send request");
+}
+
+// Read a request, and check that it is well-formed: "stats" requests have no
+// arguments, and "job" requests at least one (the program name)
+std::vector<string> readFields (Reader & reader)
+{
+  string field;
+  if (not reader.until ('\0', field, maxFieldSize))
+    throw std::runtime_error {"truncated or oversized request"};
+
+  size_t n;
+  if (not (std::istringstream {field} >> n) or n < 4 or n > maxFields)
+    throw std::runtime_error {"malformed request"};
+
+  std::vector<string> fields (n);
+  for (auto & f: fields)
+    if (not reader.until ('\0', f, maxFieldSize))
+      throw std::runtime_error {"truncated or oversized request"};
+
+  if (not ((fields[0] == "stats" and n == 4)
+           or (fields[0] == "job" and n >= 5)))
+    throw std::runtime_error {"malformed request"};
+  return fields;
+}
+
+// Stream buffer sending its contents to a socket, as frames of a given channel
+class FrameBuf : public std::streambuf {
+public:
+  FrameBuf (int fd, char channel)
+    : fd_      (fd),
+      channel_ (channel)
+  {
+    setp (buffer_, buffer_ + sizeof buffer_);
+  }
+
+  ~FrameBuf () {
+    sync();
+  }
+
+protected:
+  int overflow (int c) override {
+    if (sync() != 0)
+      return traits_type::eof();
+    if (not traits_type::eq_int_type (c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type (c);
+      pbump (1);
+    }
+    return traits_type::not_eof (c);
+  }
+
+  int sync () override {
+    const size_t n = pptr() - pbase();
+    if (n > 0) {
+      if (not sendFrame (fd_, channel_, pbase(), n))
+        return -1;
+      setp (buffer_, buffer_ + sizeof buffer_);
+    }
+    return 0;
+  }
+
+private:
+  int  fd_;
+  char channel_;
+  char buffer_[4096];
+};
+
+// State shared by the acceptor and workers
+struct State {
+  struct Pending {
+    int                 fd;
+    Clock::time_point   accepted;
+    std::vector<string> fields;
+  };
+
+  std::mutex              mutex;
+  std::condition_variable ready;
+  std::deque<Pending>     queue;
+
+  // Metrics
+  int    workers   = 0;
+  int    running   = 0;
+  size_t completed = 0;
+  size_t failed    = 0;
+  double latencySum = 0; // in milliseconds
+  double latencyMax = 0;
+};
+
+void work (std::shared_ptr<State> state, Log::Logger & log, Converter convert)
+{
+  while (true) {
+    State::Pending job;
+    {
+      std::unique_lock<std::mutex> lock {state->mutex};
+      state->ready.wait (lock, [&]{ return not state->queue.empty(); });
+      job = std::move (state->queue.front());
+      state->queue.pop_front();
+      ++state->running;
+    }
+
+    int status;
+    {
+      Socket socket {job.fd};
+      FrameBuf outBuf {socket(), '1'};
+      FrameBuf errBuf {socket(), '2'};
+      std::ostream out {&outBuf};
+      std::ostream err {&errBuf};
+
+      const Environment env {job.fields[1], job.fields[2], job.fields[3], true};
+      const std::vector<string> args (job.fields.begin() + 4, job.fields.end());
+      try {
+        status = convert (args, env, out, err);
+      } catch (std::exception & e) {
+        err << "error: " << e.what() << std::endl;
+        status = 4;
+      }
+      out.flush();
+      err.flush();
+
+      const string code = std::to_string (status);
+      sendFrame (socket(), 'x', code.data(), code.size());
+    }
+
+    const double latency = std::chrono::duration<double, std::milli>
+      (Clock::now() - job.accepted).count();
+
+    std::lock_guard<std::mutex> lock {state->mutex};
+    --state->running;
+    ++state->completed;
+    if (status != 0)
+      ++state->failed;
+    state->latencySum += latency;
+    state->latencyMax = std::max (state->latencyMax, latency);
+
+    log.write<INFO> ([&](auto&&out){
+        out << "job done in " << std::setprecision(1) << std::fixed
+            << latency << "ms (exit status " << status << ")" << std::endl;
+      });
+  }
+}
+
+void sendStats (int fd, State & state)
+{
+  std::ostringstream oss;
+  {
+    std::lock_guard<std::mutex> lock {state.mutex};
+    const double mean = state.completed > 0 ? state.latencySum / state.completed : 0;
+    oss << "{"
+        << "\"workers\": "     << state.workers
+        << ", \"queued\": "    << state.queue.size()
+        << ", \"running\": "   << state.running
+        << ", \"completed\": " << state.completed
+        << ", \"failed\": "    << state.failed
+        << std::setprecision(1) << std::fixed
+        << ", \"latency\": {\"mean\": " << mean
+        << ", \"max\": "                << state.latencyMax << "}"
+        << "}" << std::endl;
+  }
+  sendFrame (fd, '1', oss.str().data(), oss.str().size());
+  sendFrame (fd, 'x', "0", 1);
+}
+
+// Read the request of the client connected on FD, and either answer it right
+// away (metrics) or queue it for the workers
+void receive (int fd, Clock::time_point accepted,
+              std::shared_ptr<State> state, Log::Logger & log)
+{
+  // Give up on clients which do not send their request in time
+  timeval timeout {requestTimeout, 0};
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+  // Nothing may escape this detached thread: bad requests only cost their
+  // connection
+  try {
+    Reader reader {fd};
+    State::Pending job {fd, accepted, readFields (reader)};
+
+    // Metrics requests are answered right away, even if all workers are busy
+    if (job.fields[0] == "stats") {
+      sendStats (fd, *state);
+      close (fd);
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock {state->mutex};
+    state->queue.push_back (std::move (job));
+    state->ready.notify_one();
+  } catch (std::exception & e) {
+    log.msg<WARNING> (e.what());
+    close (fd);
+  }
+}
+
+int request (const string & path, const std::vector<string> & fields,
+             std::ostream & out, std::ostream & err)
+{
+  Socket socket {::socket (AF_UNIX, SOCK_STREAM, 0)};
+  if (socket() < 0)
+    fail ("could not create socket");
+
+  const auto addr = address (path);
+  if (connect (socket(), (const sockaddr*)&addr, sizeof addr) < 0)
+    fail ("could not connect to server at `" + path + "'");
+
+  sendFields (socket(), fields);
+
+  Reader reader {socket()};
+  string header;
+  string payload;
+  while (reader.until ('\n', header)) {
+    size_t len;
+    if (header.empty()
+        or not (std::istringstream {header.substr (1)} >> len)
+        or not reader.exactly (len, payload))
+      break;
+
+    switch (header[0]) {
+    case '1': out.write (payload.data(), payload.size()); break;
+    case '2': err.write (payload.data(), payload.size()); break;
+    case 'x':
+      out.flush();
+      return std::stoi (payload);
+    }
+  }
+  throw std::runtime_error {"connection to server lost"};
+}
+}
+
+int serve (const string & path, int jobs,
+           Log::Logger & log, Converter convert)
+{
+  // Clients may disconnect before their job is done
+  std::signal (SIGPIPE, SIG_IGN);
+
+  Socket listener {socket (AF_UNIX, SOCK_STREAM, 0)};
+  if (listener() < 0)
+    fail ("could not create socket");
+
+  // Only replace stale sockets, never other files
+  struct stat st;
+  if (lstat (path.c_str(), &st) == 0) {
+    if (not S_ISSOCK (st.st_mode))
+      throw std::runtime_error {"`" + path + "' exists and is not a socket"};
+    unlink (path.c_str());
+  }
+
+  const auto addr = address (path);
+  if (bind (listener(), (const sockaddr*)&addr, sizeof addr) < 0)
+    fail ("could not bind socket `" + path + "'");
+  if (listen (listener(), SOMAXCONN) < 0)
+    fail ("could not listen on socket `" + path + "'");
+
+  log.write<NOTICE> ([&](auto&&out){
+      out << "listening on `" << path << "' with "
+          << jobs << " worker(s)" << std::endl;
+    });
+
+  // Workers are detached, and keep their own reference to the shared state
+  auto state = std::make_shared<State>();
+  state->workers = jobs;
+  for (int i = 0 ; i < jobs ; ++i) {
+    std::thread {work, state, std::ref (log), convert}.detach();
+  }
+
+  while (true) {
+    const int fd = accept (listener(), nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      fail ("could not accept connection");
+    }
+
+    // Requests are read in their own thread, so that a slow client does not
+    // hold up the others
+    std::thread {receive, fd, Clock::now(), state, std::ref (log)}.detach();
+  }
+}
+
+int submit (const string & path,
+            const std::vector<string> & args, const Environment & env,
+            std::ostream & out, std::ostream & err)
+{
+  // Jobs run in the client working directory
+  char cwd[4096];
+  if (not getcwd (cwd, sizeof cwd))
+    fail ("could not get the current working directory");
+
+  std::vector<string> fields {"job", cwd, env.columns, env.lines};
+  fields.insert (fields.end(), args.begin(), args.end());
+  return request (path, fields, out, err);
+}
+
+int stats (const string & path, std::ostream & out)
+{
+  return request (path, {"stats", "", "", ""}, out, std::cerr);
+}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "logger.hxx"
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace Server {
+
+// Environment of a conversion job
+struct Environment {
+  std::string cwd;     // Relative paths are resolved from here (if not empty)
+  std::string columns; // Values of the COLUMNS and LINES environment variables
+  std::string lines;
+  bool        remote;  // Whether the job runs on behalf of a client
+};
+
+using Converter = std::function<int (const std::vector<std::string> & args,
+                                     const Environment & env,
+                                     std::ostream & out,
+                                     std::ostream & err)>;
+
+// Listen on the Unix domain socket at PATH, and run incoming jobs with
+// CONVERT, using JOBS concurrent workers. Only returns in case of error.
+int serve (const std::string & path, int jobs,
+           Log::Logger & log, Converter convert);
+
+// Run a job on the server listening at PATH, in the current working
+// directory, forwarding its standard and error outputs to OUT and ERR. Return
+// the job exit status.
+int submit (const std::string & path,
+            const std::vector<std::string> & args, const Environment & env,
+            std::ostream & out, std::ostream & err);
+
+// Print metrics of the server listening at PATH, as a JSON object
+int stats (const std::string & path, std::ostream & out);
+}
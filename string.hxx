@@ -41,6 +41,11 @@ public:
     }
   }
 
+  bool endsWith (const std::string & suffix) const {
+    return str_.size() >= suffix.size()
+      and str_.compare (str_.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
   const std::string & str() const {
     return str_;
   }
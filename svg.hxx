@@ -1,7 +1,8 @@
 #pragma once
 
+#include "format.hxx"
+#include <cstring>
 #include <string>
-#include <sstream>
 
 namespace SVG {
 class Template
@@ -11,17 +12,23 @@ public:
     : str_(str)
   {}
 
-  template <typename T>
-  Template & operator() (std::string placeholder, T value)
+  Template & operator() (const char * placeholder, const std::string & value)
   {
-    std::ostringstream oss;
-    oss << value;
+    return replace (placeholder, value.data(), value.size());
+  }
 
-    size_t pos = 0;
-    while ((pos = str_.find (placeholder, pos)) != std::string::npos) {
-      str_.replace (pos, placeholder.size(), oss.str());
-    }
-    return *this;
+  Template & operator() (const char * placeholder, const char * value)
+  {
+    return replace (placeholder, value, std::strlen (value));
+  }
+
+  // Numeric values are formatted in place, without going through a stream
+  template <typename T>
+  Template & operator() (const char * placeholder, const T & value)
+  {
+    char buffer[Format::bufferSize];
+    const char * end = Format::write (buffer, value);
+    return replace (placeholder, buffer, end - buffer);
   }
 
   const std::string & str () const
@@ -30,10 +37,22 @@ public:
   }
 
 private:
+  Template & replace (const char * placeholder,
+                      const char * value, size_t len)
+  {
+    const size_t size = std::strlen (placeholder);
+    size_t pos = 0;
+    while ((pos = str_.find (placeholder, pos, size)) != std::string::npos) {
+      str_.replace (pos, size, value, len);
+      pos += len;
+    }
+    return *this;
+  }
+
   std::string str_;
 };
 
-Template header ()
+inline Template header ()
 {
   return Template
     ("<svg xmlns='http://www.w3.org/2000/svg'"
@@ -47,13 +66,13 @@ Template header ()
      "</text>\n");
 }
 
-Template footer ()
+inline Template footer ()
 {
   return Template
     ("</svg>\n");
 }
 
-Template advertisement ()
+inline Template advertisement ()
 {
   return Template
     ("<!-- Advertisement -->\n"
@@ -65,7 +84,7 @@ Template advertisement ()
      "</a>\n");
 }
 
-Template progress ()
+inline Template progress ()
 {
   return Template
     ("<!-- Progress bar -->\n"
@@ -73,43 +92,37 @@ Template progress ()
      " style='stroke:#$COLOR; fill:none' />\n"
      "<rect x='$X0' y='$Y0' height='$DY' fill='#$COLOR'>\n"
      " <animate id='progress' attributeName='width' attributeType='XML'"
-     "  from='0' to='$DX' fill='freeze'"
+     "  from='$FROM' to='$TO' fill='freeze'"
      "  begin='start.begin' dur='$TIME' />\n"
      "</rect>\n");
 }
 
 
-Template bgHead ()
+inline Template bgHead ()
 {
   return Template
     ("<!-- Background -->\n"
      "<rect x='0' y='0' width='$WIDTH' height='$HEIGHT' fill='#$BG'/>\n");
 }
 
-Template rowBg ()
+inline Template bg ()
 {
   return Template
-    ("<g display='none'>\n"
-     " $BG\n"
+    ("<rect x='$X' y='$Y' width='$WIDTH' height='$DY' fill='#$COLOR'"
+     " display='none'>\n"
      " <set attributeType='XML' attributeName='display' to='inline'"
      "  begin='start.begin+$BEGIN' dur='$DUR'/>\n"
-     "</g>\n");
-}
-
-Template bg ()
-{
-  return Template
-    ("<rect x='$X' y='$Y' width='$WIDTH' height='$DY' fill='#$COLOR'/>");
+     "</rect>\n");
 }
 
 
-Template textHead ()
+inline Template textHead ()
 {
   return Template
     (" <!-- Text -->\n");
 }
 
-Template rowText ()
+inline Template rowText ()
 {
   return Template
     ("<text x='$X' y='$Y' dominant-baseline='text-before-edge' textLength='$WIDTH'"
@@ -120,13 +133,54 @@ Template rowText ()
      "</text>\n");
 }
 
-Template propHead () {
+inline Template propHead () {
   return Template
     ("<tspan$COLOR$BOLD$UNDERLINE>");
 }
 
-Template propFoot () {
+inline Template propFoot () {
   return Template
     ("</tspan>");
 }
+
+
+// HTML wrapper for segmented animations: segments are loaded on demand, and
+// the previous one is only removed once the next one is displayed.
+inline Template wrapper () {
+  return Template
+    ("<!DOCTYPE html>\n"
+     "<html>\n"
+     "<head><meta charset='utf-8'/></head>\n"
+     "<body>\n"
+     "<div id='script2svg' style='position:relative; width:$WIDTHpx; height:$HEIGHTpx'></div>\n"
+     "<script>\n"
+     "(function () {\n"
+     "  var chunks = [\n"
+     "$CHUNKS"
+     "  ];\n"
+     "  var root = document.getElementById('script2svg');\n"
+     "  function show (i) {\n"
+     "    var next = (i+1) % chunks.length;\n"
+     "    var obj = document.createElement('object');\n"
+     "    obj.type = 'image/svg+xml';\n"
+     "    obj.data = chunks[i].file;\n"
+     "    obj.style.position = 'absolute';\n"
+     "    obj.onload = function () {\n"
+     "      while (root.firstChild !== obj) root.removeChild(root.firstChild);\n"
+     "      if (window.fetch) fetch(chunks[next].file);\n"
+     "      setTimeout(function () { show(next); }, 1000 * chunks[i].dur);\n"
+     "    };\n"
+     "    root.appendChild(obj);\n"
+     "  }\n"
+     "  show(0);\n"
+     "})();\n"
+     "</script>\n"
+     "</body>\n"
+     "</html>\n");
+}
+
+inline Template wrapperChunk () {
+  return Template
+    ("    {file: '$FILE', dur: $DUR},\n");
+}
 }
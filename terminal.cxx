@@ -1,10 +1,14 @@
 #include "svg.hxx"
 #include "terminal.hxx"
+#include <algorithm>
+#include <exception>
 #include <fstream>
 #include <iomanip>
 #include <memory>
 #include <stdexcept>
 #include <sstream>
+#include <thread>
+#include <tuple>
 
 using Log::ERROR;
 using Log::WARNING;
@@ -12,7 +16,6 @@ using Log::NOTICE;
 using Log::INFO;
 using Log::DEBUG;
 
-namespace po = boost::program_options;
 using std::string;
 
 namespace TSM {
@@ -40,42 +43,51 @@ enum vte_color {
   COLOR_NUM
 };
 
-const string & color (int code, const Terminal * term) {
+const string & color (int code, const TerminalOptions::Color & palette) {
   static const string undefined = "xxxxxx";
 
   switch (code) {
   case COLOR_BLACK:
   case COLOR_DARK_GREY:
-    return term->opt().color.black;
+    return palette.black;
   case COLOR_RED:
   case COLOR_LIGHT_RED:
-    return term->opt().color.red;
+    return palette.red;
   case COLOR_GREEN:
   case COLOR_LIGHT_GREEN:
-    return term->opt().color.green;
+    return palette.green;
   case COLOR_YELLOW:
   case COLOR_LIGHT_YELLOW:
-    return term->opt().color.yellow;
+    return palette.yellow;
   case COLOR_BLUE:
   case COLOR_LIGHT_BLUE:
-    return term->opt().color.blue;
+    return palette.blue;
   case COLOR_MAGENTA:
   case COLOR_LIGHT_MAGENTA:
-    return term->opt().color.magenta;
+    return palette.magenta;
   case COLOR_CYAN:
   case COLOR_LIGHT_CYAN:
-    return term->opt().color.cyan;
+    return palette.cyan;
   case COLOR_LIGHT_GREY:
   case COLOR_WHITE:
-    return term->opt().color.white;
+    return palette.white;
   case COLOR_FOREGROUND:
-    return term->opt().color.fg;
+    return palette.fg;
   case COLOR_BACKGROUND:
-    return term->opt().color.bg;
+    return palette.bg;
   }
 
   return undefined;
 }
+
+// Text states are stored as raw characters, without markup: each change in
+// the text properties is represented by this marker, followed by the color
+// code, and bold and underline flags. Color codes range from -1 (colors which
+// are not in the palette, such as 256-color or RGB ones) to COLOR_NUM, and are
+// offset so as to remain printable. A cell holding the marker itself is
+// represented by the marker twice.
+constexpr char propMarker  = '\x01';
+constexpr int  colorOffset = 64;
 }
 
 bool Cell::Prop::operator!= (const Prop & other) const
@@ -85,6 +97,33 @@ bool Cell::Prop::operator!= (const Prop & other) const
     or   underline != other.underline;
 }
 
+bool Cell::operator!= (const Cell & other) const
+{
+  return ch   != other.ch
+    or   prop != other.prop
+    or   bg   != other.bg;
+}
+
+
+namespace {
+// Call F(b, e, window) for each part [b, e) of [BEGIN, END) falling in one of
+// WINDOWS, which are sorted and disjoint
+template <typename F>
+void clip (const std::vector<Window> & windows,
+           long long begin, long long end, F f)
+{
+  auto it = std::upper_bound (windows.begin(), windows.end(), begin,
+                              [](long long t, const Window & w){
+                                return t < w.end;
+                              });
+  for ( ; it != windows.end() and it->begin < end ; ++it) {
+    const long long b = std::max (begin, it->begin);
+    const long long e = std::min (end,   it->end);
+    if (e > b)
+      f (b, e, *it);
+  }
+}
+}
 
 void AnimatedRow::update ()
 {
@@ -94,149 +133,542 @@ void AnimatedRow::update ()
   if (tstate_.empty()             // No previous state
       or tstate_.back().end >= 0) // Old previous state
     upd = true;
-  else if (tstate_.back().state != newState) {
+  else if (last_ != newState) {
     // Change in state
     upd = true;
     tstate_.back().end = term_->time();
   }
 
   if (upd and newState != "") {
+    size_t prefix = 0;
+    size_t suffix = 0;
+    const size_t common = std::min (last_.size(), newState.size());
+    while (prefix < common
+           and last_[prefix] == newState[prefix])
+      ++prefix;
+    while (suffix < common - prefix
+           and last_[last_.size()-1-suffix] == newState[newState.size()-1-suffix])
+      ++suffix;
+
     tstate_.push_back (TimedState {
-        newState, term_->time(), -1});
+        uint (prefix), uint (suffix),
+        newState.substr (prefix, newState.size() - prefix - suffix),
+        term_->time(), -1});
+    last_ = newState;
   }
 }
 
-void AnimatedRow::draw () const
+// Frames are built from the states to be drawn with the current timing
+// settings. States shorter than the resolution are never visible. Frames
+// shorter than the minimum frame duration are collapsed into the state
+// following them, so that the last state of a burst is always shown.
+AnimatedRow::Cursor::Cursor (const AnimatedRow & row)
+  : row_ (&row), next_ (0), pending_ (false), valid_ (false)
+{
+  const auto & timing = row_->term_->opt().timing;
+  minTicks_ = (timing.frame + timing.resolution - 1) / timing.resolution;
+  pending_ = read ();
+  next ();
+}
+
+// Read the next visible state; return false past the last one
+bool AnimatedRow::Cursor::read ()
 {
-  auto & out = term_->out();
-  for (const auto & tstate: tstate_) {
-    const double end = tstate.end > 0 ? tstate.end : term_->time();
-    drawState (tstate.state,
-               tstate.begin,
-               end - tstate.begin);
+  const int resolution = row_->term_->opt().timing.resolution;
+  while (next_ < row_->tstate_.size()) {
+    const auto & tstate = row_->tstate_[next_++];
+    state_.replace (tstate.prefix, state_.size() - tstate.prefix - tstate.suffix,
+                    tstate.text);
+
+    const double stop = tstate.end > 0 ? tstate.end : row_->term_->time();
+
+    // Round both ends (rather than the duration) so that consecutive states
+    // stay contiguous
+    stateBegin_ = Format::Time::fromSeconds (tstate.begin, resolution).ticks();
+    stateEnd_   = Format::Time::fromSeconds (stop,         resolution).ticks();
+    if (stateEnd_ > stateBegin_)
+      return true;
+  }
+  return false;
+}
+
+// Move to the next frame, which starts with the pending state
+void AnimatedRow::Cursor::next ()
+{
+  valid_ = pending_;
+  if (not valid_)
+    return;
+
+  frame_ = state_;
+  begin_ = stateBegin_;
+  end_   = stateEnd_;
+  while ((pending_ = read ())
+         and end_ == stateBegin_ and end_ - begin_ < minTicks_) {
+    frame_ = state_;
+    end_   = stateEnd_;
+  }
+}
+
+// Draw the frames intersecting WINDOW, from CURSOR on. A frame going on past
+// the window is left to the next one.
+void AnimatedRow::draw (std::ostream & out, const TerminalOptions & opt,
+                        const Window & window, Cursor & cursor) const
+{
+  const int resolution = term_->opt().timing.resolution;
+  for ( ; not cursor.done() and cursor.begin() < window.end ; cursor.next()) {
+    const long long b = std::max (cursor.begin(), window.begin);
+    const long long e = std::min (cursor.end(),   window.end);
+    if (e > b)
+      drawState (out, opt, cursor.frame(),
+                 Format::Time (b - window.begin, resolution),
+                 Format::Time (e - b, resolution));
+    if (cursor.end() > window.end)
+      break;
+  }
+}
+
+void AnimatedRow::estimate (Estimate & est, const TerminalOptions & opt,
+                            const std::vector<Window> & windows) const
+{
+  const int resolution = term_->opt().timing.resolution;
+  const size_t base = overhead (opt);
+  for (Cursor cursor {*this} ; not cursor.done() ; cursor.next()) {
+    const size_t size = base + stateSize (cursor.frame(), opt);
+    clip (windows, cursor.begin(), cursor.end(),
+          [&](long long b, long long e, const Window & window){
+            est.bytes += size
+              + Format::length (Format::Time (b - window.begin, resolution))
+              + Format::length (Format::Time (e - b, resolution));
+            ++est.elements;
+          });
   }
 }
 
 string RowText::state () const
 {
-  std::ostringstream oss;
+  string state;
   bool empty = true;
 
   const Cell::Prop defaultProp {TSM::COLOR_FOREGROUND, false, false};
   Cell::Prop currentProp = defaultProp;
 
   const auto & cellRow = term_->cellRow(row_);
+  state.reserve (cellRow.size());
   for (const auto & cell: cellRow) {
     if (cell.ch == ' ') {
-      oss << "&#160;";
-    } else {
-      empty = false;
-
-      if (cell.prop != currentProp) {
-        if (currentProp != defaultProp)
-          oss << SVG::propFoot().str();
-
-        currentProp = cell.prop;
-        if (currentProp != defaultProp)
-          oss << SVG::propHead()
-            ("$COLOR", currentProp.fg == TSM::COLOR_FOREGROUND ? "" :
-             " fill='#"+TSM::color(currentProp.fg, term_)+"'")
-            ("$BOLD", not currentProp.bold ? "" :
-             " font-weight='bold'")
-            ("$UNDERLINE", not currentProp.underline ? "" :
-             " text-decoration='underline'")
-            .str();
-      }
+      state += ' ';
+      continue;
+    }
+    empty = false;
+
+    if (cell.prop != currentProp) {
+      currentProp = cell.prop;
+      state += TSM::propMarker;
+      state += char (TSM::colorOffset + currentProp.fg);
+      state += currentProp.bold      ? 'b' : '-';
+      state += currentProp.underline ? 'u' : '-';
+    }
 
-      switch (cell.ch)  {
-      case '<': oss << "&lt;";  break;
-      case '>': oss << "&gt;";  break;
-      case '&': oss << "&amp;"; break;
-      default:  oss << cell.ch;
-      }
+    if (cell.ch == TSM::propMarker) {
+      state += TSM::propMarker;
+      state += TSM::propMarker;
+    } else {
+      state += cell.ch;
     }
   }
-  if (currentProp != defaultProp)
-    oss << SVG::propFoot().str();
 
   if (empty)
     return "";
 
-  return oss.str();
+  return state;
+}
+
+namespace {
+// Attributes of text properties
+string colorAttr (const string & color) {
+  return " fill='#" + color + "'";
+}
+const string boldAttr      = " font-weight='bold'";
+const string underlineAttr = " text-decoration='underline'";
+
+// Call F(prop, bold, underline) for each change of text properties in STATE,
+// and G(ch) for each character
+template <typename F, typename G>
+void parseState (const string & state, F f, G g)
+{
+  for (size_t i = 0 ; i < state.size() ; ++i) {
+    if (state[i] != TSM::propMarker) {
+      g (state[i]);
+    } else if (state[i+1] == TSM::propMarker) {
+      g (state[++i]);
+    } else {
+      f (state[i+1] - TSM::colorOffset, state[i+2] == 'b', state[i+3] == 'u');
+      i += 3;
+    }
+  }
+}
 }
 
-void RowText::drawState (const string & state,
-                         double begin, double dur) const
+// Build the SVG markup of STATE, with the colors of PALETTE
+string RowText::markup (const string & state,
+                        const TerminalOptions::Color & palette) const
 {
-  term_->out() << SVG::rowText()
+  string text;
+  text.reserve (2 * state.size());
+  bool inProp = false;
+
+  parseState (state, [&](int fg, bool bold, bool underline){
+      if (inProp)
+        text += SVG::propFoot().str();
+
+      inProp = fg != TSM::COLOR_FOREGROUND or bold or underline;
+      if (inProp)
+        text += SVG::propHead()
+          ("$COLOR", fg == TSM::COLOR_FOREGROUND ? "" :
+           colorAttr (TSM::color (fg, palette)))
+          ("$BOLD",      bold      ? boldAttr      : "")
+          ("$UNDERLINE", underline ? underlineAttr : "")
+          .str();
+    }, [&](char ch){
+      switch (ch) {
+      case ' ': text += "&#160;"; break;
+      case '<': text += "&lt;";   break;
+      case '>': text += "&gt;";   break;
+      case '&': text += "&amp;";  break;
+      case TSM::propMarker: text += ' '; break;
+      default:  text += ch;
+      }
+    });
+
+  if (inProp)
+    text += SVG::propFoot().str();
+
+  return text;
+}
+
+void RowText::drawState (std::ostream & out, const TerminalOptions & opt,
+                         const string & state,
+                         Format::Time begin, Format::Time dur) const
+{
+  out << SVG::rowText()
     ("$X",     1)
-    ("$Y",     1 + row_ * term_->opt().font.dy)
-    ("$WIDTH", term_->opt().font.dx * term_->opt().columns)
-    ("$TEXT",  state)
+    ("$Y",     1 + row_ * opt.font.dy)
+    ("$WIDTH", opt.font.dx * opt.columns)
+    ("$TEXT",  markup (state, opt.color))
     ("$BEGIN", begin)
     ("$DUR",   dur)
     .str();
 }
 
-string RowBg::state () const
+size_t RowText::overhead (const TerminalOptions & opt) const
+{
+  return SVG::rowText()
+    ("$X",     1)
+    ("$Y",     1 + row_ * opt.font.dy)
+    ("$WIDTH", opt.font.dx * opt.columns)
+    ("$TEXT",  "")
+    ("$BEGIN", "")
+    ("$DUR",   "")
+    .str().size();
+}
+
+// Size of the markup of STATE, computed without building it
+size_t RowText::stateSize (const string & state,
+                           const TerminalOptions & opt) const
+{
+  static const size_t headSize = SVG::propHead()
+    ("$COLOR", "")("$BOLD", "")("$UNDERLINE", "").str().size();
+  static const size_t footSize  = SVG::propFoot().str().size();
+  static const size_t colorSize = colorAttr ("").size();
+
+  size_t size = 0;
+  bool inProp = false;
+
+  parseState (state, [&](int fg, bool bold, bool underline){
+      if (inProp)
+        size += footSize;
+
+      inProp = fg != TSM::COLOR_FOREGROUND or bold or underline;
+      if (inProp)
+        size += headSize
+          + (fg == TSM::COLOR_FOREGROUND ? 0 :
+             colorSize + TSM::color (fg, opt.color).size())
+          + (bold      ? boldAttr.size()      : 0)
+          + (underline ? underlineAttr.size() : 0);
+    }, [&](char ch){
+      switch (ch) {
+      case ' ': size += 6; break;
+      case '<': size += 4; break;
+      case '>': size += 4; break;
+      case '&': size += 5; break;
+      default:  size += 1;
+      }
+    });
+
+  if (inProp)
+    size += footSize;
+
+  return size;
+}
+
+void Background::init (Terminal * term)
+{
+  term_ = term;
+  open_.resize (term_->opt().rows);
+}
+
+void Background::update (const std::vector<char> & changed)
+{
+  const double time = term_->time();
+
+  for (uint row = 0 ; row < term_->opt().rows ; ++row) {
+    if (not changed[row])
+      continue;
+
+    // Current runs in this row
+    std::vector<Run> current;
+    int currentBg = TSM::COLOR_BACKGROUND;
+    uint col0 = 0;
+
+    auto addRun = [&](uint col) {
+      if (currentBg != TSM::COLOR_BACKGROUND)
+        current.push_back (Run {row, col0, col, currentBg, time, -1});
+    };
+
+    const auto & cellRow = term_->cellRow(row);
+    for (uint col = 0 ; col < term_->opt().columns ; ++col) {
+      const auto & cell = cellRow[col];
+
+      if (cell.bg != currentBg) {
+        addRun (col);
+        currentBg = cell.bg;
+        col0 = col;
+      }
+    }
+    addRun (term_->opt().columns);
+
+    // Close open runs which are not current anymore; keep the others alive
+    auto & open = open_[row];
+    std::vector<size_t> stillOpen;
+    for (size_t i : open) {
+      auto & run = run_[i];
+      auto it = std::find_if (current.begin(), current.end(), [&](const Run & r){
+          return r.col0  == run.col0
+            and  r.col1  == run.col1
+            and  r.color == run.color;
+        });
+
+      if (it == current.end()) {
+        run.end = time;
+      } else {
+        current.erase (it);
+        stillOpen.push_back (i);
+      }
+    }
+
+    // Open new runs
+    for (const auto & run : current) {
+      stillOpen.push_back (run_.size());
+      run_.push_back (run);
+    }
+    open.swap (stillOpen);
+  }
+}
+
+// Merged background rectangles to be drawn with the current timing settings
+std::vector<Background::Region> Background::regions () const
 {
-  std::ostringstream oss;
-  int currentBg = TSM::COLOR_BACKGROUND;
-  uint col0 = 0;
+  // Regions are keyed on rounded timings, so that runs which can not be told
+  // apart in the output get merged too.
+  const auto & timing = term_->opt().timing;
+  const int resolution = timing.resolution;
+  const long long minTicks = std::max ((timing.frame + resolution - 1) / resolution, 1);
+  std::vector<Region> region;
+  region.reserve (run_.size());
+  for (const auto & run : run_) {
+    const double end = run.end >= 0 ? run.end : term_->time();
+    const auto begin = Format::Time::fromSeconds (run.begin, resolution);
+    const auto stop  = Format::Time::fromSeconds (end, resolution);
+    if (stop.ticks() - begin.ticks() >= minTicks)
+      region.push_back (Region {run.color, run.col0, run.col1,
+                                begin.ticks(), stop.ticks(),
+                                run.row, run.row + 1});
+  }
 
-  auto outputBg = [&](uint col) {
-    if (currentBg != TSM::COLOR_BACKGROUND)
-      oss << SVG::bg()
-        ("$X",     1 + col0 * term_->opt().font.dx)
-        ("$Y",     1 + row_ * term_->opt().font.dy)
-        ("$WIDTH", (col-col0) * term_->opt().font.dx)
-        ("$DY",    term_->opt().font.dy)
-        ("$COLOR", TSM::color (currentBg, term_))
-        .str();
+  auto key = [](const Region & r) {
+    return std::make_tuple (r.color, r.col0, r.col1, r.begin, r.end);
   };
 
-  const auto & cellRow = term_->cellRow(row_);
-  for (uint col = 0 ; col < term_->opt().columns ; ++col) {
-    const auto & cell = cellRow[col];
+  std::sort (region.begin(), region.end(), [&](const Region & a, const Region & b){
+      return std::make_tuple (key(a), a.row0) < std::make_tuple (key(b), b.row0);
+    });
 
-    if (cell.bg != currentBg) {
-      outputBg (col);
-      currentBg = cell.bg;
-      col0 = col;
+  // Merge vertically adjacent runs
+  auto last = region.begin();
+  for (auto it = region.begin() ; it != region.end() ; ++it) {
+    if (it == last)
+      continue;
+    if (key(*it) == key(*last) and it->row0 == last->row1) {
+      last->row1 = it->row1;
+    } else {
+      *(++last) = *it;
     }
   }
-  outputBg (term_->opt().columns);
+  if (not region.empty())
+    region.erase (++last, region.end());
 
-  return oss.str();
+  return region;
 }
 
-void RowBg::drawState (const string & state,
-                       double begin, double dur) const
+Background::Cursor::Cursor (const Background & bg)
+  : region_ (bg.regions()), start_ (region_.size()), next_ (0)
 {
-  term_->out() << SVG::rowBg()
-    ("$BG", state)
-    ("$BEGIN", begin)
-    ("$DUR", dur)
-    .str();
+  for (size_t i = 0 ; i < start_.size() ; ++i) {
+    start_[i] = i;
+  }
+  std::stable_sort (start_.begin(), start_.end(), [&](size_t a, size_t b){
+      return region_[a].begin < region_[b].begin;
+    });
+}
+
+// Draw the regions intersecting WINDOW, in the same order in all windows
+void Background::draw (std::ostream & out, const TerminalOptions & opt,
+                       const Window & window, Cursor & cursor) const
+{
+  const auto & font = opt.font;
+  const int resolution = term_->opt().timing.resolution;
+  const auto & region = cursor.region_;
+  auto & active = cursor.active_;
+
+  while (cursor.next_ < cursor.start_.size()
+         and region[cursor.start_[cursor.next_]].begin < window.end)
+    active.push_back (cursor.start_[cursor.next_++]);
+  std::sort (active.begin(), active.end());
+
+  for (size_t i : active) {
+    const auto & r = region[i];
+    const long long b = std::max (r.begin, window.begin);
+    const long long e = std::min (r.end,   window.end);
+    if (e <= b)
+      continue;
+
+    out << SVG::bg()
+      ("$X",     1 + r.col0 * font.dx)
+      ("$Y",     1 + r.row0 * font.dy)
+      ("$WIDTH", (r.col1 - r.col0) * font.dx)
+      ("$DY",    (r.row1 - r.row0) * font.dy)
+      ("$COLOR", TSM::color (r.color, opt.color))
+      ("$BEGIN", Format::Time (b - window.begin, resolution))
+      ("$DUR",   Format::Time (e - b, resolution))
+      .str();
+  }
+
+  // Only regions going on past the window are left for the next one
+  active.erase (std::remove_if (active.begin(), active.end(), [&](size_t i){
+        return region[i].end <= window.end;
+      }), active.end());
+}
+
+void Background::estimate (Estimate & est, const TerminalOptions & opt,
+                           const std::vector<Window> & windows) const
+{
+  const auto & font = opt.font;
+  const int resolution = term_->opt().timing.resolution;
+  const size_t base = SVG::bg()
+    ("$X", "")("$Y", "")("$WIDTH", "")("$DY", "")
+    ("$COLOR", "")("$BEGIN", "")("$DUR", "")
+    .str().size();
+
+  for (const auto & r : regions()) {
+    const size_t size = base
+      + Format::length (1 + r.col0 * font.dx)
+      + Format::length (1 + r.row0 * font.dy)
+      + Format::length ((r.col1 - r.col0) * font.dx)
+      + Format::length ((r.row1 - r.row0) * font.dy)
+      + TSM::color (r.color, opt.color).size();
+    clip (windows, r.begin, r.end,
+          [&](long long b, long long e, const Window & window){
+            est.bytes += size
+              + Format::length (Format::Time (b - window.begin, resolution))
+              + Format::length (Format::Time (e - b, resolution));
+            ++est.elements;
+          });
+  }
+}
+
+namespace {
+// Derive the cell size from the font size, unless given
+void setCellSize (TerminalOptions::Font & font)
+{
+  if (font.dx == 0) {
+    font.dx = font.size * 0.67;
+  }
+
+  if (font.dy == 0) {
+    font.dy = std::max (font.size * 1.3,
+                        font.size + 2.);
+  }
+}
+
+// Name of the I-th segment file of an animation written to OUTPUT
+string segmentName (const string & output, int i)
+{
+  string base = output;
+  const auto dot   = base.rfind ('.');
+  const auto slash = base.rfind ('/');
+  if (dot != string::npos
+      and (slash == string::npos or dot > slash))
+    base.erase (dot);
+
+  std::ostringstream name;
+  name << base << "." << std::setw(3) << std::setfill('0') << i << ".svg";
+  return name.str();
 }
 
-Terminal::Terminal (Options & options,
-                    Log::Logger & log)
+// Flush OUT, written to OUTPUT ("-" for the standard output), and report
+// write errors
+void checkOutput (std::ostream & out, const string & output)
+{
+  out.flush();
+  if (out.fail())
+    throw std::runtime_error (output == "-"
+                              ? string ("could not write to the standard output")
+                              : "could not write file `" + output + "'");
+}
+}
+
+Terminal::Terminal (const Options & options,
+                    const std::vector<Options> & variants,
+                    Log::Logger & log,
+                    std::ostream & stdOut)
   : opt_        (options),
+    variants_   (variants),
     log_        (log),
     screen_     (log),
     vte_        (log, screen_()),
-    time_       (0),
-    lastUpdate_ (0)
+    time_         (0),
+    lastUpdate_   (0),
+    shouldUpdate_ (0),
+    bytes_        (0),
+    updates_      (0),
+    finished_     (false)
 {
+  if (opt().timing.resolution <= 0 or opt().timing.frame < 0)
+    throw std::runtime_error ("invalid timing settings");
+
+  setCellSize (opt_.font);
+  for (auto & variant: variants_) {setCellSize (variant.font);}
+
   // Handle output
   if (opt().output != "-") {
     log_.write<INFO> ([&](auto&&out){
         out << "setting output to file `" << this->opt().output << "'" << std::endl;
       });
     out_.reset (new std::ofstream (opt().output), /*owner*/true);
+    if (out().fail())
+      throw std::runtime_error ("could not write file `" + opt().output + "'");
   } else {
-    out_.reset (&std::cout, /*owner*/false);
+    out_.reset (&stdOut, /*owner*/false);
   }
 
   // Initialize cell matrix
@@ -252,75 +684,347 @@ Terminal::Terminal (Options & options,
     for (uint row=0 ; row<opt().rows ; ++row) {
       cell_[row].resize(opt().columns);
     }
+    dirty_.assign (opt().rows, true);
+  }
+
+  // Variant outputs are opened right away, so that errors are reported
+  // before the emulation
+  for (const auto & variant: variants_) {
+    log_.write<INFO> ([&](auto&&out){
+        out << "setting variant output to file `" << variant.output << "'" << std::endl;
+      });
+    variantOut_.emplace_back (new std::ofstream (variant.output));
+    if (variantOut_.back()->fail())
+      throw std::runtime_error ("could not write file `" + variant.output + "'");
+  }
+
+  // Segment files are only written at the end: make sure beforehand that they
+  // can be created
+  if (opt().segment > 0 and not opt().analyze) {
+    std::vector<string> outputs {opt().output};
+    for (const auto & variant: variants_) {outputs.push_back (variant.output);}
+    for (const auto & output: outputs) {
+      const string name = segmentName (output, 0);
+      if (std::ofstream {name}.fail())
+        throw std::runtime_error ("could not write segment file `" + name + "'");
+    }
   }
 
   // Initialize row vectors
   rowText_.resize (opt().rows);
-  rowBg_.resize (opt().rows);
   for (uint row=0 ; row<opt().rows ; ++row) {
     rowText_[row].init (this, row);
-    rowBg_[row].init   (this, row);
   }
+  background_.init (this);
+}
 
-  const int width = 1 + opt().font.dx*(0.5+opt().columns);
+namespace {
+// Size of the terminal area, including the progress bar
+int termWidth (const TerminalOptions & opt) {
+  return 1 + opt.font.dx*(0.5+opt.columns);
+}
 
-  const int height = 1 + opt().font.dy*(0.5+opt().rows) + opt().progress.height;
+int termHeight (const TerminalOptions & opt) {
+  return 1 + opt.font.dy*(0.5+opt.rows) + opt.progress.height;
+}
 
-  out() << SVG::header()
-    ("$FONT",   opt().font.family)
-    ("$SIZE",   opt().font.size)
-    ("$FG",     opt().color.fg)
-    ("$WIDTH",  width + opt().font.size + 1)
-    ("$HEIGHT", height + 1)
+// Size of the SVG document
+int svgWidth (const TerminalOptions & opt) {
+  return termWidth (opt) + opt.font.size + 1;
+}
+
+int svgHeight (const TerminalOptions & opt) {
+  return termHeight (opt) + 1;
+}
+
+string svgHeader (const TerminalOptions & opt)
+{
+  string header = SVG::header()
+    ("$FONT",   opt.font.family)
+    ("$SIZE",   opt.font.size)
+    ("$FG",     opt.color.fg)
+    ("$WIDTH",  svgWidth (opt))
+    ("$HEIGHT", svgHeight (opt))
     .str();
 
-  if (opt().ad.text != "") {
-    out() << SVG::advertisement()
-      ("$X",    width)
-      ("$Y",    height)
-      ("$SIZE", int (opt().font.size * 0.75))
-      ("$URL",  opt().ad.url)
-      ("$TEXT", opt().ad.text)
+  if (opt.ad.text != "") {
+    header += SVG::advertisement()
+      ("$X",    termWidth (opt))
+      ("$Y",    termHeight (opt))
+      ("$SIZE", int (opt.font.size * 0.75))
+      ("$URL",  opt.ad.url)
+      ("$TEXT", opt.ad.text)
       .str();
   }
+  return header;
+}
 }
 
-Terminal::~Terminal ()
+// Time windows of the segments or, without segmentation, of the whole
+// animation. The last window extends to END, past the TOTAL duration.
+std::vector<Window> Terminal::windows (long long total, long long end) const
 {
-  // Progress bar
-  out() << SVG::progress()
+  if (opt().segment <= 0)
+    return {Window {0, end}};
+
+  const int resolution = opt().timing.resolution;
+  const long long length = std::max (std::llround (opt().segment * 1000 / resolution), 1LL);
+
+  std::vector<Window> windows;
+  for (long long i = 0 ; i == 0 or i * length < total ; ++i) {
+    windows.push_back (Window {i * length,
+          (i+1) * length >= total ? end : (i+1) * length});
+  }
+  return windows;
+}
+
+// Draw the whole animation to OUT, with the fonts and colors of OPT
+void Terminal::render (std::ostream & out, const Options & opt,
+                       long long total, long long end) const
+{
+  Cursors cursors {Background::Cursor {background_}, {}};
+  cursors.rows.reserve (rowText_.size());
+  for (const auto & row: rowText_) {cursors.rows.emplace_back (row);}
+
+  if (this->opt().segment > 0) {
+    segments (out, opt, windows (total, end), total, cursors);
+  } else {
+    drawSVG (out, opt, Window {0, end}, total, cursors);
+  }
+}
+
+// Beginning of the SVG document showing WINDOW: header, progress bar and
+// background color. The progress bar still shows the position in the whole
+// animation, which lasts TOTAL ticks.
+string Terminal::svgHead (const Options & opt,
+                          const Window & window, long long total) const
+{
+  const int resolution = this->opt().timing.resolution;
+  const double dx = opt.font.dx * opt.columns;
+  const long long progressEnd = std::min (window.end, total);
+
+  return svgHeader (opt)
+    + SVG::progress()
     ("$X0",    1)
-    ("$Y0",    1 + opt().font.dy * (opt().rows + 0.5))
-    ("$DX",    opt().font.dx * opt().columns)
-    ("$DY",    opt().progress.height)
-    ("$TIME",  time_)
-    ("$COLOR", opt().progress.color)
+    ("$Y0",    1 + opt.font.dy * (opt.rows + 0.5))
+    ("$DX",    opt.font.dx * opt.columns)
+    ("$DY",    opt.progress.height)
+    ("$FROM",  total > 0 ? dx * window.begin / total : 0.)
+    ("$TO",    total > 0 ? dx * progressEnd  / total : dx)
+    ("$TIME",  Format::Time (std::max (progressEnd - window.begin, 0LL), resolution))
+    ("$COLOR", opt.progress.color)
+    .str()
+    + SVG::bgHead()
+    ("$WIDTH",  opt.font.dx * opt.columns + 2)
+    ("$HEIGHT", opt.font.dy * opt.rows + 2)
+    ("$BG",     opt.color.bg)
     .str();
-  time_ += 0.01;
+}
+
+// Draw the part of the animation in WINDOW as a self-contained SVG document.
+// Windows are drawn in order, CURSORS resuming where the previous one stopped.
+void Terminal::drawSVG (std::ostream & out, const Options & opt,
+                        const Window & window, long long total,
+                        Cursors & cursors) const
+{
+  out << svgHead (opt, window, total);
 
   // Background
-  out() << SVG::bgHead()
-    ("$WIDTH",  opt().font.dx * opt().columns + 2)
-    ("$HEIGHT", opt().font.dy * opt().rows + 2)
-    ("$BG",     opt().color.bg)
-    .str();
-  for (const auto & row: rowBg_) {row.draw();}
+  background_.draw (out, opt, window, cursors.background);
 
   // Text
-  out() << SVG::textHead().str();
-  for (const auto & row: rowText_) {row.draw();}
+  out << SVG::textHead().str();
+  for (size_t i = 0 ; i < rowText_.size() ; ++i) {
+    rowText_[i].draw (out, opt, window, cursors.rows[i]);
+  }
 
   // SVG footer
-  out() << SVG::footer().str();
+  out << SVG::footer().str();
+}
+
+// HTML page playing in turn the segments of the animation written to
+// OPT.output, which show WINDOWS
+string Terminal::wrapper (const Options & opt,
+                          const std::vector<Window> & windows) const
+{
+  const int resolution = this->opt().timing.resolution;
+
+  string chunks;
+  for (size_t i = 0 ; i < windows.size() ; ++i) {
+    const string name = segmentName (opt.output, i);
+    const auto slash = name.rfind ('/');
+    chunks += SVG::wrapperChunk()
+      ("$FILE", slash == string::npos ? name : name.substr (slash+1))
+      ("$DUR",  Format::Time (windows[i].end - windows[i].begin, resolution))
+      .str();
+  }
+
+  return SVG::wrapper()
+    ("$WIDTH",  svgWidth (opt))
+    ("$HEIGHT", svgHeight (opt))
+    ("$CHUNKS", chunks)
+    .str();
+}
+
+// Draw each of WINDOWS in its own SVG segment file, named after the output
+// file. OUT gets an HTML wrapper, which loads and plays the segments in turn.
+void Terminal::segments (std::ostream & out, const Options & opt,
+                         const std::vector<Window> & windows,
+                         long long total, Cursors & cursors) const
+{
+  for (size_t i = 0 ; i < windows.size() ; ++i) {
+    const string name = segmentName (opt.output, i);
+    std::ofstream file {name};
+    if (file.fail())
+      throw std::runtime_error ("could not write segment file `" + name + "'");
+    {
+      std::lock_guard<std::mutex> lock {logMutex_};
+      log_.write<INFO> ([&](auto&&out){
+          out << "writing segment `" << name << "'" << std::endl;
+        });
+    }
+    drawSVG (file, opt, windows[i], total, cursors);
+    checkOutput (file, name);
+  }
+
+  out << wrapper (opt, windows);
+}
+
+// Footprint of the output drawn with the fonts and colors of OPT
+Estimate Terminal::estimate (double duration, const Options & opt) const
+{
+  const int resolution = this->opt().timing.resolution;
+  const long long total = Format::Time::fromSeconds (duration, resolution).ticks();
+  const long long end   = Format::Time::fromSeconds (time_,    resolution).ticks();
+  const auto windows = this->windows (total, end);
+
+  // Each segment repeats the header and footer
+  Estimate est {0, 0};
+  const size_t textSize = SVG::textHead().str().size() + SVG::footer().str().size();
+  for (const auto & window: windows) {
+    est.bytes += svgHead (opt, window, total).size() + textSize;
+  }
+  if (opt.segment > 0)
+    est.bytes += wrapper (opt, windows).size();
+
+  background_.estimate (est, opt, windows);
+  for (const auto & row: rowText_) {row.estimate (est, opt, windows);}
+  return est;
+}
+
+// Degrade the timing settings until the estimated output size fits in the
+// budget: first coarsen the time resolution, then merge ever longer frames, up
+// to the whole animation. The budget applies to each output: variants may be
+// larger than the main output, so the largest one is considered.
+void Terminal::fitSize (double duration)
+{
+  auto largest = [&]{
+    Estimate est = estimate (duration, opt());
+    for (const auto & variant: variants_) {
+      const Estimate variantEst = estimate (duration, variant);
+      if (variantEst.bytes > est.bytes)
+        est = variantEst;
+    }
+    return est;
+  };
+
+  const Estimate initial = largest();
+  log_.write<INFO> ([&](auto&&out){
+      out << "estimated output size: " << initial.bytes << " bytes" << std::endl;
+    });
+  if (initial.bytes <= opt().maxSize)
+    return;
+
+  auto & timing = opt_.timing;
+  const int totalMs = 1000 * duration;
+  Estimate est = initial;
+  while (est.bytes > opt().maxSize) {
+    if (timing.resolution < 10) {
+      timing.resolution = 10;
+    } else if (timing.frame < totalMs) {
+      timing.frame = std::min (std::max (2 * timing.frame, 40), totalMs);
+      timing.resolution = std::max (timing.resolution,
+                                    std::min (timing.frame / 10, 100));
+    } else {
+      break;
+    }
+    est = largest();
+  }
 
   log_.write<NOTICE> ([&](auto&&out){
-      out << "animation duration: "
-          << std::setprecision(2) << std::fixed << this->time_ << "s." << std::endl;
+      out << "estimated output size (" << initial.bytes << " bytes)"
+          << " exceeds the budget of " << this->opt().maxSize << " bytes;"
+          << " degrading quality:" << std::endl;
+    });
+  log_.write<NOTICE> ([&](auto&&out){
+      out << "  time resolution: " << timing.resolution << "ms" << std::endl;
     });
+  if (timing.frame > 0 and timing.frame >= totalMs) {
+    log_.write<NOTICE> ([&](auto&&out){
+        out << "  the animation is reduced to a still image of its final state" << std::endl;
+      });
+  } else {
+    log_.write<NOTICE> ([&](auto&&out){
+        out << "  frames shorter than " << timing.frame << "ms are merged" << std::endl;
+      });
+  }
+  log_.write<NOTICE> ([&](auto&&out){
+      out << "  SVG elements: " << initial.elements << " -> " << est.elements
+          << "; estimated size: " << est.bytes << " bytes" << std::endl;
+    });
+
+  if (est.bytes > opt().maxSize) {
+    log_.write<WARNING> ([&](auto&&out){
+        out << "could not fit the output in " << this->opt().maxSize << " bytes" << std::endl;
+      });
+  }
+}
+
+// Print metrics about the recording as a JSON object
+void Terminal::analyze (double duration) const
+{
+  auto quote = [](const string & str) {
+    std::ostringstream oss;
+    oss << '"';
+    for (char c: str) {
+      switch (c) {
+      case '"':  oss << "\\\""; break;
+      case '\\': oss << "\\\\"; break;
+      default:
+        if (static_cast<unsigned char>(c) < ' ')
+          oss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+              << int (c) << std::dec;
+        else
+          oss << c;
+      }
+    }
+    oss << '"';
+    return oss.str();
+  };
+
+  size_t rowStates = 0;
+  for (const auto & row: rowText_) {rowStates += row.states();}
+
+  const Estimate est = estimate (duration, opt());
+
+  out() << "{"
+        << "\"script\": "         << quote (scriptPath_)
+        << ", \"timing\": "       << quote (timingPath_)
+        << ", \"duration\": "     << std::setprecision(3) << std::fixed << duration
+        << ", \"bytes\": "        << bytes_
+        << ", \"updates\": "      << updates_
+        << ", \"rowStates\": "    << rowStates
+        << ", \"bgRuns\": "       << background_.runs()
+        << ", \"elements\": "     << est.elements
+        << ", \"estimatedSize\": " << est.bytes
+        << "}" << std::endl;
 }
 
 void Terminal::play (const string & scriptPath, const string timingPath)
 {
+  scriptPath_ = scriptPath;
+  timingPath_ = timingPath;
+
   std::ifstream script {scriptPath, std::ifstream::in};
   if (script.fail()) {
     std::ostringstream oss;
@@ -328,11 +1032,6 @@ void Terminal::play (const string & scriptPath, const string timingPath)
     throw std::runtime_error {oss.str()};
   }
 
-  { // Discard first line
-    string discard;
-    std::getline(script, discard);
-  }
-
   std::ifstream timing {timingPath, std::ifstream::in};
   if (timing.fail()) {
     std::ostringstream oss;
@@ -340,6 +1039,15 @@ void Terminal::play (const string & scriptPath, const string timingPath)
     throw std::runtime_error {oss.str()};
   }
 
+  play (script, timing);
+}
+
+void Terminal::play (std::istream & script, std::istream & timing)
+{
+  { // Discard first line
+    string discard;
+    std::getline(script, discard);
+  }
 
   constexpr int bufferSize {30};
   std::unique_ptr<char[]> bufGuard {new char [bufferSize]};
@@ -354,7 +1062,6 @@ void Terminal::play (const string & scriptPath, const string timingPath)
     timing >> discard;
   }
 
-  double shouldUpdate = 0;
   while (true) {
     int nb;
     timing >> nb;
@@ -364,18 +1071,7 @@ void Terminal::play (const string & scriptPath, const string timingPath)
       double delay = 2;
       timing >> delay;
 
-      if (shouldUpdate < 0
-          and time_ > lastUpdate_ + 0.01) {
-        shouldUpdate = time_;
-      }
-
-      if (shouldUpdate >= 0
-          and time_ + delay > shouldUpdate + 0.01) {
-        update();
-        shouldUpdate = -1;
-      }
-
-      time_ += delay;
+      advance (time_ + delay);
 
       while (nb>0) {
         const int n = std::min(nb, bufferSize-1);
@@ -385,7 +1081,7 @@ void Terminal::play (const string & scriptPath, const string timingPath)
             ("premature end of script file; stopping processing here.");
         }
 
-        tsm_vte_input (vte_(), buffer, n);
+        input (buffer, n);
 
         log_.write<DEBUG> ([&buffer, &n, &delay, this](auto&&out){
             out << "[term input] " << std::setfill(' ');
@@ -411,7 +1107,7 @@ void Terminal::play (const string & scriptPath, const string timingPath)
         nb -= n;
       }
     } else if (timing.eof()) {
-      update();
+      finish();
       break;
     } else {
       throw std::runtime_error
@@ -420,6 +1116,92 @@ void Terminal::play (const string & scriptPath, const string timingPath)
   }
 }
 
+void Terminal::feed (const char * data, size_t len, double timestamp)
+{
+  advance (std::max (timestamp, time_));
+  input (data, len);
+}
+
+void Terminal::finish ()
+{
+  if (finished_)
+    return;
+  finished_ = true;
+  update();
+
+  const double duration = time_;
+  time_ += 0.01;
+
+  if (opt().maxSize > 0)
+    fitSize (duration);
+
+  if (opt().analyze) {
+    analyze (duration);
+    return;
+  }
+
+  const int resolution = opt().timing.resolution;
+  const long long total = Format::Time::fromSeconds (duration, resolution).ticks();
+  const long long end   = Format::Time::fromSeconds (time_,    resolution).ticks();
+
+  // Variants share the emulated timeline, and are serialized in parallel.
+  // Errors are only reported once all threads are joined.
+  std::vector<std::exception_ptr> error (variants_.size() + 1);
+  std::vector<std::thread> threads;
+  for (size_t i = 0 ; i < variants_.size() ; ++i) {
+    threads.emplace_back ([&, i]{
+        try {
+          render (*variantOut_[i], variants_[i], total, end);
+          checkOutput (*variantOut_[i], variants_[i].output);
+        } catch (...) {
+          error[i] = std::current_exception();
+        }
+      });
+  }
+
+  try {
+    render (out(), opt(), total, end);
+    checkOutput (out(), opt().output);
+  } catch (...) {
+    error.back() = std::current_exception();
+  }
+
+  for (auto & thread: threads) {thread.join();}
+  for (const auto & e: error) {
+    if (e)
+      std::rethrow_exception (e);
+  }
+
+  log_.write<NOTICE> ([&](auto&&out){
+      out << "animation duration: "
+          << std::setprecision(2) << std::fixed << this->time_ << "s." << std::endl;
+    });
+}
+
+// Move the clock forward to TIME, taking a snapshot of the screen beforehand
+// if it has been stable long enough
+void Terminal::advance (double time)
+{
+  if (shouldUpdate_ < 0
+      and time_ > lastUpdate_ + 0.01) {
+    shouldUpdate_ = time_;
+  }
+
+  if (shouldUpdate_ >= 0
+      and time > shouldUpdate_ + 0.01) {
+    update();
+    shouldUpdate_ = -1;
+  }
+
+  time_ = time;
+}
+
+void Terminal::input (const char * data, size_t len)
+{
+  tsm_vte_input (vte_(), data, len);
+  bytes_ += len;
+}
+
 void Terminal::update ()
 {
   log_.write<DEBUG> ([&](auto&&out){
@@ -429,9 +1211,15 @@ void Terminal::update ()
     });
   tsm_screen_draw (screen_(), update, this);
   lastUpdate_ = time_;
+  ++updates_;
 
-  for (auto & row : rowText_) {row.update();}
-  for (auto & row : rowBg_)   {row.update();}
+  // Rows whose cells did not change keep their current state
+  for (uint row=0 ; row<opt().rows ; ++row) {
+    if (dirty_[row])
+      rowText_[row].update();
+  }
+  background_.update (dirty_);
+  dirty_.assign (opt().rows, false);
 }
 
 int Terminal::update (struct tsm_screen *screen, uint32_t id,
@@ -447,7 +1235,7 @@ int Terminal::update (struct tsm_screen *screen, uint32_t id,
   if (col >= term->opt().columns)
     return 1;
 
-  auto & cell = term->cell_[row][col];
+  Cell cell;
 
   cell.prop.fg = attr->fccode;
   cell.bg = attr->bccode;
@@ -465,5 +1253,11 @@ int Terminal::update (struct tsm_screen *screen, uint32_t id,
     cell.ch = ' ';
   }
 
+  auto & current = term->cell_[row][col];
+  if (cell != current) {
+    current = cell;
+    term->dirty_[row] = true;
+  }
+
   return 0;
 }
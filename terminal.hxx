@@ -2,12 +2,72 @@
 
 #include "memory.hxx"
 #include "logger.hxx"
+#include "format.hxx"
 #include "tsm.hxx"
+#include <memory>
+#include <mutex>
+#include <iostream>
 #include <vector>
-#include <boost/program_options.hpp>
 
 class Terminal;
 
+// Also known as Terminal::Options. Defaults match those of the command line.
+struct TerminalOptions {
+  std::string output  = "-";
+  size_t      maxSize = 0;     // in bytes; 0 means unlimited
+  bool        analyze = false;
+  double      segment = 0;     // in seconds; 0 means no segmentation
+
+  // Terminal
+  int columns = 80;
+  int rows    = 24;
+
+  // Fonts
+  struct Font {
+    std::string family = "monospace";
+    int         size   = 12;
+    int         dx     = 0;    // Cell size; 0 means derived from the font size
+    int         dy     = 0;
+  };
+  Font font;
+
+  // Timing
+  struct Timing {
+    int resolution = 1; // in milliseconds
+    int frame      = 0; // in milliseconds
+  };
+  Timing timing;
+
+  // Progress bar
+  struct Progress {
+    int         height = 5;
+    std::string color  = "0000aa";
+  };
+  Progress progress;
+
+  // Colors
+  struct Color {
+    std::string fg      = "000000";
+    std::string bg      = "ffffff";
+    std::string black   = "000000";
+    std::string red     = "aa0000";
+    std::string green   = "00aa00";
+    std::string yellow  = "aa5500";
+    std::string blue    = "0000aa";
+    std::string magenta = "aa00aa";
+    std::string cyan    = "00aaaa";
+    std::string white   = "aaaaaa";
+  };
+  Color color;
+
+  // Advertisement
+  struct Ad {
+    std::string text = "Produced by script2svg";
+    std::string url  = "http://github.com/ffevotte/script2svg";
+  };
+  Ad ad;
+};
+
 struct Cell {
   struct Prop {
     bool operator!= (const Prop & other) const;
@@ -16,11 +76,25 @@ struct Cell {
     int  underline;
   };
 
+  bool operator!= (const Cell & other) const;
+
   char ch;
   Prop prop;
   int  bg;
 };
 
+// Footprint of (part of) the SVG output
+struct Estimate {
+  size_t bytes;
+  size_t elements;
+};
+
+// Time window of the animation, in ticks
+struct Window {
+  long long begin;
+  long long end;
+};
+
 class AnimatedRow {
 public:
   void init (Terminal * term, uint row) {
@@ -28,51 +102,179 @@ public:
     row_  = row;
   }
 
+  // Walks through the frames to be drawn with the current timing settings.
+  // Windows are drawn in order, each one resuming where the previous one
+  // stopped, so that the deltas are only replayed once.
+  class Cursor {
+  public:
+    explicit Cursor (const AnimatedRow & row);
+
+    bool done () const {return not valid_;}
+    void next ();
+
+    const std::string & frame () const {return frame_;}
+    long long begin () const {return begin_;}
+    long long end () const {return end_;}
+
+  private:
+    bool read ();
+
+    const AnimatedRow * row_;
+    long long   minTicks_;
+    size_t      next_;       // Next state to read
+    std::string state_;      // Last state read, rebuilt from the deltas...
+    long long   stateBegin_; // ... and its timings
+    long long   stateEnd_;
+    bool        pending_;    // Whether the last state read starts a frame
+    std::string frame_;      // Current frame
+    long long   begin_;
+    long long   end_;
+    bool        valid_;
+  };
+
   void update ();
-  void draw () const;
+  void draw (std::ostream & out, const TerminalOptions & opt,
+             const Window & window, Cursor & cursor) const;
+  void estimate (Estimate & est, const TerminalOptions & opt,
+                 const std::vector<Window> & windows) const;
+
+  size_t states () const {return tstate_.size();}
 
 protected:
   virtual std::string state () const = 0;
-  virtual void drawState (const std::string & state,
-                          double begin, double dur) const = 0;
+  virtual void drawState (std::ostream & out, const TerminalOptions & opt,
+                          const std::string & state,
+                          Format::Time begin, Format::Time dur) const = 0;
+
+  // Size of a drawn state, not counting the state itself and its timings
+  virtual size_t overhead (const TerminalOptions & opt) const = 0;
+
+  // Size of a state once drawn
+  virtual size_t stateSize (const std::string & state,
+                            const TerminalOptions & opt) const = 0;
+
   const Terminal * term_;
   uint row_;
 
 private:
+  // States are stored as deltas against the previous one: the first PREFIX
+  // and last SUFFIX characters are kept, and TEXT is inserted in between.
   struct TimedState {
-    std::string state;
+    uint        prefix;
+    uint        suffix;
+    std::string text;
     double begin;
     double end;
   };
 
   std::vector<TimedState> tstate_;
+  std::string             last_; // Last stored state
 };
 
+// Text states hold raw characters and text properties: their SVG markup, which
+// depends on the palette, is only built when drawing.
 class RowText : public AnimatedRow {
 private:
   std::string state () const;
-  void drawState (const std::string & state,
-                  double begin, double dur) const;
+  std::string markup (const std::string & state,
+                      const TerminalOptions::Color & palette) const;
+  void drawState (std::ostream & out, const TerminalOptions & opt,
+                  const std::string & state,
+                  Format::Time begin, Format::Time dur) const;
+  size_t overhead (const TerminalOptions & opt) const;
+  size_t stateSize (const std::string & state,
+                    const TerminalOptions & opt) const;
 };
 
-class RowBg : public AnimatedRow {
+// Background color runs are tracked individually (rather than per row), so
+// that vertically adjacent runs sharing the same color and lifetime can be
+// drawn as a single rectangle.
+class Background {
+public:
+  void init (Terminal * term);
+
+  // Only rows flagged in CHANGED are examined
+  void update (const std::vector<char> & changed);
+
 private:
-  std::string state () const;
-  void drawState (const std::string & state,
-                  double begin, double dur) const;
+  struct Run {
+    uint   row;
+    uint   col0;
+    uint   col1;
+    int    color;
+    double begin;
+    double end;
+  };
+
+  // Merged runs, with timings in ticks
+  struct Region {
+    int       color;
+    uint      col0;
+    uint      col1;
+    long long begin;
+    long long end;
+    uint      row0;
+    uint      row1;
+  };
+
+public:
+  // Walks through the merged regions in consecutive windows, so that they are
+  // only built and sorted once
+  class Cursor {
+  public:
+    explicit Cursor (const Background & bg);
+
+  private:
+    friend class Background;
+    std::vector<Region> region_; // In drawing order
+    std::vector<size_t> start_;  // Indices of regions, by beginning time
+    size_t              next_;   // Next region of START_ to become active
+    std::vector<size_t> active_; // Regions going on in the current window
+  };
+
+  void draw (std::ostream & out, const TerminalOptions & opt,
+             const Window & window, Cursor & cursor) const;
+  void estimate (Estimate & est, const TerminalOptions & opt,
+                 const std::vector<Window> & windows) const;
+
+  size_t runs () const {return run_.size();}
+
+private:
+  std::vector<Region> regions () const;
+
+  const Terminal * term_;
+  std::vector<Run> run_;
+  std::vector<std::vector<size_t>> open_; // Per row: indices of open runs
 };
 
 class Terminal {
 public:
-  struct Options;
+  using Options = TerminalOptions;
 
-  Terminal (Options & opt,
-            Log::Logger & log);
-
-  ~Terminal ();
+  // Output VARIANTS are drawn from the same emulation, with their own
+  // fonts, colors, progress bar, advertisement and output file. Options are
+  // copied: timing settings may be degraded to fit the size budget.
+  Terminal (const Options & opt,
+            const std::vector<Options> & variants,
+            Log::Logger & log,
+            std::ostream & stdOut);
 
+  // Play a whole recording, from script and timing files...
   void play (const std::string & scriptPath, const std::string timingPath);
 
+  // ... or from streams (e.g. in-memory buffers) with the same contents
+  void play (std::istream & script, std::istream & timing);
+
+  // Alternatively, play a recording incrementally: input LEN bytes of DATA,
+  // TIMESTAMP seconds after the beginning of the session, then call finish()
+  // once all data has been fed.
+  void feed (const char * data, size_t len, double timestamp);
+
+  // Draw the animation to the outputs (play() does it at the end of the
+  // recording). Errors throw std::runtime_error, once all outputs are done
+  // with. Further calls have no effect.
+  void finish ();
+
   std::ostream & out () const {return *(out_.get());}
   double time () const {return time_;}
 
@@ -83,7 +285,31 @@ public:
   const Options & opt () const {return opt_;}
 
 private:
+  // Drawing state, carried from one window to the next
+  struct Cursors {
+    Background::Cursor               background;
+    std::vector<AnimatedRow::Cursor> rows;
+  };
+
+  void advance (double time);
+  void input (const char * data, size_t len);
   void update ();
+  Estimate estimate (double duration, const Options & opt) const;
+  void fitSize (double duration);
+  void analyze (double duration) const;
+  std::vector<Window> windows (long long total, long long end) const;
+  void render (std::ostream & out, const Options & opt,
+               long long total, long long end) const;
+  std::string svgHead (const Options & opt,
+                       const Window & window, long long total) const;
+  void drawSVG (std::ostream & out, const Options & opt,
+                const Window & window, long long total,
+                Cursors & cursors) const;
+  std::string wrapper (const Options & opt,
+                       const std::vector<Window> & windows) const;
+  void segments (std::ostream & out, const Options & opt,
+                 const std::vector<Window> & windows, long long total,
+                 Cursors & cursors) const;
 
   // Static wrapper for C-style callbacks
   static int update (struct tsm_screen *screen, uint32_t id,
@@ -92,60 +318,24 @@ private:
                      const struct tsm_screen_attr *attr,
                      tsm_age_t age, void *data);
 
-  Options &            opt_;
+  Options              opt_;
+  std::vector<Options> variants_;
+  std::vector<std::unique_ptr<std::ostream>> variantOut_;
   Log::Logger &        log_;
+  mutable std::mutex   logMutex_;
   POptr<std::ostream>  out_;
+  std::string          scriptPath_;
+  std::string          timingPath_;
   TSM::Screen          screen_;
   TSM::VTE             vte_;
   double               time_;
   double               lastUpdate_;
+  double               shouldUpdate_;
+  size_t               bytes_;
+  size_t               updates_;
   std::vector<RowText> rowText_;
-  std::vector<RowBg>   rowBg_;
+  Background           background_;
   std::vector<std::vector<Cell>> cell_;
-};
-
-struct Terminal::Options {
-  std::string output;
-
-  // Terminal
-  int columns;
-  int rows;
-
-  // Fonts
-  struct Font {
-    std::string family;
-    int         size;
-    int         dx;
-    int         dy;
-  };
-  Font font;
-
-  // Progress bar
-  struct Progress {
-    int         height;
-    std::string color;
-  };
-  Progress progress;
-
-  // Colors
-  struct Color {
-    std::string fg;
-    std::string bg;
-    std::string black;
-    std::string red;
-    std::string green;
-    std::string yellow;
-    std::string blue;
-    std::string magenta;
-    std::string cyan;
-    std::string white;
-  };
-  Color color;
-
-  // Advertisement
-  struct Ad {
-    std::string text;
-    std::string url;
-  };
-  Ad ad;
+  std::vector<char>    dirty_; // Per row: whether cells changed since last update
+  bool                 finished_;
 };
@@ -0,0 +1,207 @@
+// Performance check: convert a synthetic session, and the same session played
+// twice as long. The longer conversion serves as a reference run: the output
+// size, number of animated elements, conversion time and memory usage should
+// all grow linearly with the length of the session. Absolute values depend on
+// the machine and on the libtsm version, and are only reported.
+//
+// Usage: bench TIME_TOLERANCE RSS_TOLERANCE
+//
+// The check fails if:
+// - the estimated output size differs from the actual size,
+// - the output size or number of animated elements grows faster than the
+//   session length,
+// - the conversion time or memory usage grows more than TIME_TOLERANCE
+//   (resp. RSS_TOLERANCE) times faster than the session length.
+
+#include "terminal.hxx"
+#include <sys/resource.h>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+using std::string;
+
+namespace {
+
+// Slack allowed on the growth of the output: timings get longer as the session
+// goes on
+constexpr double outputTolerance = 1.1;
+
+// Stream buffer discarding its contents, only counting them
+class CountBuf : public std::streambuf {
+public:
+  size_t count = 0;
+
+protected:
+  int overflow (int c) override {
+    ++count;
+    return traits_type::not_eof (c);
+  }
+
+  std::streamsize xsputn (const char *, std::streamsize n) override {
+    count += n;
+    return n;
+  }
+};
+
+// Feed a deterministic session of PHASES phases, mixing scrolling colored
+// output, progress bars and full-screen redraws, and write its conversion
+// with options OPT to OUT
+void convert (Log::Logger & log, int phases, const Terminal::Options & opt,
+              std::ostream & out)
+{
+  Terminal term {opt, {}, log, out};
+  double time = 0;
+  auto feed = [&](const string & data, double delay) {
+    time += delay;
+    term.feed (data.data(), data.size(), time);
+  };
+
+  for (int phase = 0 ; phase < phases ; ++phase) {
+    // Scrolling output
+    for (int i = 0 ; i < 300 ; ++i) {
+      std::ostringstream line;
+      line << "\033[3" << (i+phase) % 8 << "m" << std::setw(6) << i
+           << "\033[0m " << string ((i * 7 + phase) % 70, 'a' + i % 26)
+           << "\r\n";
+      feed (line.str(), 0.013);
+    }
+
+    // Progress bar
+    for (int i = 0 ; i <= 100 ; ++i) {
+      std::ostringstream line;
+      line << "\r\033[K\033[7m" << string (i * 60 / 100, ' ')
+           << "\033[0m " << i << "%";
+      feed (line.str(), 0.05);
+    }
+    feed ("\r\n", 0.1);
+
+    // Full-screen application
+    feed ("\033[?1049h\033[H\033[2J", 0.3);
+    for (int frame = 0 ; frame < 20 ; ++frame) {
+      std::ostringstream screen;
+      screen << "\033[H\033[7m frame " << frame << "\033[K\033[0m";
+      for (int row = 2 ; row <= 24 ; ++row) {
+        screen << "\033[" << row << ";1H\033[K"
+               << "\033[4" << (row+frame) % 8 << "m"
+               << std::setw(5) << row * frame << "\033[0m "
+               << string ((row * frame) % 60, '#');
+      }
+      feed (screen.str(), 0.5);
+    }
+    feed ("\033[?1049l", 0.3);
+
+    // Idle gap
+    feed ("$ ", 20);
+  }
+  term.finish();
+}
+
+// Peak resident set size, in kilobytes
+long peakRSS ()
+{
+  rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+struct Measure {
+  size_t bytes;
+  size_t elements;
+  size_t estimatedSize;
+  double seconds;
+  long   rss;      // Growth of the peak RSS, in kilobytes
+};
+
+// Convert a session of PHASES phases with options OPT
+Measure measure (Log::Logger & log, int phases, Terminal::Options opt)
+{
+  Measure m {};
+
+  // Keep the best of a few runs, to reduce the noise on timings
+  const long initialRSS = peakRSS();
+  for (int run = 0 ; run < 3 ; ++run) {
+    CountBuf buf;
+    std::ostream out {&buf};
+    const auto start = std::chrono::steady_clock::now();
+    convert (log, phases, opt, out);
+    const std::chrono::duration<double> elapsed
+      = std::chrono::steady_clock::now() - start;
+    if (run == 0 or elapsed.count() < m.seconds)
+      m.seconds = elapsed.count();
+    m.bytes = buf.count;
+  }
+  m.rss = peakRSS() - initialRSS;
+
+  // Extract the numeric fields of the JSON object output by --analyze
+  opt.analyze = true;
+  std::ostringstream out;
+  convert (log, phases, opt, out);
+  std::map<string, double> metrics;
+  std::istringstream json {out.str()};
+  string key;
+  while (std::getline (json, key, '"') and std::getline (json, key, '"')) {
+    char colon;
+    double value;
+    if (json >> colon >> value)
+      metrics[key] = value;
+    json.clear();
+  }
+  m.elements      = metrics["elements"];
+  m.estimatedSize = metrics["estimatedSize"];
+
+  std::cout << std::setprecision(3) << std::fixed
+            << phases << " phases: " << m.bytes << " bytes, "
+            << m.elements << " elements, " << m.seconds << "s, RSS +"
+            << m.rss << "kB" << std::endl;
+  return m;
+}
+}
+
+int main (int argc, char ** argv)
+{
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " TIME_TOLERANCE RSS_TOLERANCE" << std::endl;
+    return 1;
+  }
+  const double timeTolerance = std::atof (argv[1]);
+  const double rssTolerance  = std::atof (argv[2]);
+
+  Log::Logger log {std::cerr};
+  log.level (Log::WARNING);
+
+  // Default settings, on a 80x24 terminal. The shorter session is converted
+  // first, so that the peak RSS only grows with the longer one.
+  constexpr int phases = 4;
+  const Terminal::Options opt;
+  const Measure ref  = measure (log, phases,   opt);
+  const Measure test = measure (log, 2*phases, opt);
+
+  int status = 0;
+  auto check = [&](bool ok, const string & what) {
+    if (not ok) {
+      std::cout << "error: " << what << std::endl;
+      status = 1;
+    }
+  };
+
+  for (const auto & m: {ref, test}) {
+    check (m.estimatedSize == m.bytes,
+           "estimated output size (" + std::to_string (m.estimatedSize)
+           + " bytes) differs from the actual size");
+  }
+
+  check (test.bytes <= 2 * outputTolerance * ref.bytes,
+         "output size grows faster than the session length");
+  check (test.elements <= 2 * outputTolerance * ref.elements,
+         "number of animated elements grows faster than the session length");
+  check (test.seconds <= 2 * timeTolerance * ref.seconds,
+         "conversion time grows faster than the session length");
+  check (test.rss <= 2 * rssTolerance * std::max (ref.rss, 1L),
+         "memory usage grows faster than the session length");
+
+  return status;
+}
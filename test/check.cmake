@@ -0,0 +1,138 @@
+# Convert a recorded session, and check the produced files.
+#
+# Variables:
+#   SCRIPT2SVG  path to the script2svg executable
+#   RECORDING   path of the recording, without the .script/.timing extension
+#   ARGS        command-line arguments (;-separated list). The recording is
+#               available as `session.script' and `session.timing', and all
+#               produced files should be named `out*'.
+#   SERVER      if true, run the conversion through a conversion server, and
+#               check that it produces the same files as a direct conversion
+#   OUTDIR      directory where the conversion is run
+#   EXPECTED    file listing the expected contents of the produced files
+#   MAX_SIZE    if set, maximum total size of the produced files
+#
+# Each line of the EXPECTED file has the form
+#   FILE REGEX
+# meaning that FILE should contain a match for REGEX, or
+#   FILE !REGEX
+# meaning that it should not (or not exist at all). Empty lines and lines starting with `#' are
+# ignored.
+
+file (REMOVE_RECURSE ${OUTDIR})
+file (MAKE_DIRECTORY ${OUTDIR})
+configure_file (${RECORDING}.script ${OUTDIR}/session.script COPYONLY)
+configure_file (${RECORDING}.timing ${OUTDIR}/session.timing COPYONLY)
+
+set (command ${SCRIPT2SVG} -v 1 ${ARGS} session.script session.timing)
+if (SERVER)
+  file (WRITE ${OUTDIR}/connect.sh [=[
+script2svg=$1; shift
+"$script2svg" --serve server.sock -j 1 -v 1 & server=$!
+for i in $(seq 50); do [ -S server.sock ] && break; sleep 0.1; done
+"$script2svg" --connect server.sock "$@"; status=$?
+kill $server
+exit $status
+]=])
+  set (serverCommand sh connect.sh ${command})
+endif ()
+
+# Run the command given as extra arguments, and return in VAR the hashes of the
+# produced files, as lines of the form `HASH  FILE'
+function (convert var)
+  file (GLOB outputs RELATIVE ${OUTDIR} ${OUTDIR}/out*)
+  if (outputs)
+    file (REMOVE ${outputs})
+  endif ()
+
+  execute_process (
+    COMMAND ${ARGN}
+    WORKING_DIRECTORY ${OUTDIR}
+    RESULT_VARIABLE status
+    ERROR_VARIABLE  errors)
+  if (NOT status EQUAL 0)
+    message (FATAL_ERROR "conversion failed (exit status ${status}):\n${errors}")
+  endif ()
+
+  file (GLOB outputs RELATIVE ${OUTDIR} ${OUTDIR}/out*)
+  if (NOT outputs)
+    message (FATAL_ERROR "no output produced")
+  endif ()
+  list (SORT outputs)
+  set (hashes "")
+  foreach (output ${outputs})
+    file (SHA256 ${OUTDIR}/${output} hash)
+    set (hashes "${hashes}${hash}  ${output}\n")
+  endforeach ()
+  set (${var} "${hashes}" PARENT_SCOPE)
+endfunction ()
+
+# The conversion must be deterministic...
+convert (hashes ${command})
+convert (hashesAgain ${command})
+if (NOT hashes STREQUAL hashesAgain)
+  message (FATAL_ERROR "non-deterministic output:\n${hashes}vs.\n${hashesAgain}")
+endif ()
+
+# ... and not depend on where it runs
+if (SERVER)
+  convert (hashesAgain ${serverCommand})
+  if (NOT hashes STREQUAL hashesAgain)
+    message (FATAL_ERROR "the server output differs from the direct conversion:\n"
+      "${hashesAgain}vs.\n${hashes}")
+  endif ()
+endif ()
+
+if (MAX_SIZE)
+  file (GLOB outputs ${OUTDIR}/out*)
+  set (size 0)
+  foreach (output ${outputs})
+    file (SIZE ${output} outputSize)
+    math (EXPR size "${size} + ${outputSize}")
+  endforeach ()
+  if (size GREATER MAX_SIZE)
+    message (FATAL_ERROR "output size (${size} bytes) exceeds ${MAX_SIZE} bytes")
+  endif ()
+endif ()
+
+# Semicolons are protected, so that lines can be handled as a CMake list
+file (READ ${EXPECTED} expected)
+string (REPLACE ";" "<semicolon>" expected "${expected}")
+string (REPLACE "\n" ";" expected "${expected}")
+
+set (failures "")
+foreach (line IN LISTS expected)
+  string (REPLACE "<semicolon>" ";" line "${line}")
+  if (line STREQUAL "" OR line MATCHES "^#")
+    continue ()
+  endif ()
+  if (NOT line MATCHES "^([^ ]+) (!?)(.+)$")
+    message (FATAL_ERROR "malformed line in `${EXPECTED}':\n${line}")
+  endif ()
+  set (output ${CMAKE_MATCH_1})
+  set (negated "${CMAKE_MATCH_2}")
+  set (regex "${CMAKE_MATCH_3}")
+
+  if (NOT EXISTS ${OUTDIR}/${output})
+    if (NOT negated)
+      set (failures "${failures}missing file: ${output}\n")
+    endif ()
+    continue ()
+  endif ()
+  file (READ ${OUTDIR}/${output} contents)
+  string (REPLACE ";" "<semicolon>" contents "${contents}")
+  string (REPLACE ";" "<semicolon>" regex "${regex}")
+  if (contents MATCHES "${regex}")
+    if (negated)
+      set (failures "${failures}unexpected match in ${output}: ${CMAKE_MATCH_0}\n")
+    endif ()
+  elseif (NOT negated)
+    set (failures "${failures}no match in ${output}: ${regex}\n")
+  endif ()
+endforeach ()
+string (REPLACE "<semicolon>" ";" failures "${failures}")
+
+if (failures)
+  message (FATAL_ERROR "unexpected output:\n${failures}")
+endif ()
+message (STATUS "output matches its expected contents:\n${hashes}")